@@ -1,5 +1,5 @@
 
-#include "intcode.hpp"
+#include "../intcode/intcode.hpp"
 
 namespace {
 
@@ -56,7 +56,7 @@ auto paint_hull = [](const auto& prog, colour start_colour = colour::black)
     direction current_dir = direction::north;
     panels[current_pos] = start_colour;
 
-    auto vm = intcode{prog};
+    auto vm = aoc::intcode{prog};
 
     auto get_colour = [&] {
         auto col = colour::black;
@@ -67,23 +67,31 @@ auto paint_hull = [](const auto& prog, colour start_colour = colour::black)
         return static_cast<int64_t>(col);
     };
 
-    while (!vm.done()) {
-        {
-            auto col = vm.next_output(get_colour);
-            panels[current_pos] = static_cast<colour>(col);
+    // The robot's outputs alternate between a colour to paint and a turn
+    bool expect_colour = true;
+
+    for (auto ev = vm.resume(); ev != aoc::event::halted; ev = vm.resume()) {
+        if (ev == aoc::event::need_input) {
+            vm.push_input(get_colour());
+            continue;
         }
 
-        {
-            auto dir = vm.next_output(get_colour);
-            if (dir == 1) {
+        const auto val = vm.output();
+
+        if (expect_colour) {
+            panels[current_pos] = static_cast<colour>(val);
+        } else {
+            if (val == 1) {
                 current_dir = turn_right(current_dir);
-            } else if (dir == 0 ) {
+            } else if (val == 0 ) {
                 current_dir = turn_left(current_dir);
             } else {
-                throw std::runtime_error(fmt::format("Expected direction, got {}\n", dir));
+                throw std::runtime_error(fmt::format("Expected direction, got {}\n", val));
             }
             current_pos = update_position(current_pos, current_dir);
         }
+
+        expect_colour = !expect_colour;
     }
 
     return panels;
@@ -111,7 +119,7 @@ auto print_map = [](auto const& map) {
 
 int main(int argc, char** argv)
 {
-    const auto prog = load_program(argv[1]);
+    const auto prog = aoc::load_program(argv[1]);
 
     {
         const auto map = paint_hull(prog);
@@ -1,7 +1,8 @@
 
-#include "intcode.hpp"
+#include "../intcode/trace.hpp"
 
 #include <thread>
+#include <utility>
 #include <curses.h>
 
 namespace {
@@ -26,16 +27,16 @@ auto to_char = [](tile_type t) -> chtype {
 
 // Part one
 auto count_blocks = [](auto const& prog) {
-    auto vm = intcode(prog);
+    auto vm = aoc::intcode{prog};
     int num_blocks = 0;
 
-    while (!vm.done()) {
-        const auto in_fn = [] { return 0; };
-        vm.next_output(in_fn); // x coord
-        vm.next_output(in_fn); // y coord
-        const auto b = vm.next_output(in_fn);
+    // Outputs come in (x, y, tile) triples: we only care about the tiles
+    int num_outputs = 0;
 
-        if (b == 2) {
+    for (auto ev = vm.resume(); ev != aoc::event::halted; ev = vm.resume()) {
+        if (ev == aoc::event::need_input) {
+            vm.push_input(0);
+        } else if (++num_outputs % 3 == 0 && vm.output() == 2) {
             ++num_blocks;
         }
     }
@@ -45,12 +46,102 @@ auto count_blocks = [](auto const& prog) {
 
 enum class play_mode {
     manual,
-    cpu
+    cpu,
+    headless
 };
 
+// The screen, kept in memory as a grid which grows to fit whatever is drawn
+// on it. render() hands over just the cells which have changed since it was
+// last called, so a frame can be drawn without touching the rest of the
+// screen, and keeps count of the frames and tiles it has seen.
+struct framebuffer {
+    int64_t score = 0;
+
+    void set_tile(int64_t x, int64_t y, tile_type t)
+    {
+        if (x < 0 || y < 0) {
+            return;
+        }
+        if (x >= width_ || y >= height_) {
+            resize(nano::max(width_, x + 1), nano::max(height_, y + 1));
+        }
+        cells_[y * width_ + x] = static_cast<char>(to_char(t));
+        dirty_.emplace_back(x, y);
+        ++frame_tiles_;
+    }
+
+    // Calls draw(x, y, c) for each cell which differs from when it was
+    // last drawn
+    template <typename DrawFn>
+    void render(DrawFn draw)
+    {
+        for (const auto& [x, y] : dirty_) {
+            const auto i = y * width_ + x;
+            if (cells_[i] != shown_[i]) {
+                draw(x, y, cells_[i]);
+                shown_[i] = cells_[i];
+            }
+        }
+        dirty_.clear();
+        ++frames_;
+        tiles_ += frame_tiles_;
+        last_frame_tiles_ = std::exchange(frame_tiles_, 0);
+    }
+
+    int64_t height() const { return height_; }
+
+    std::string_view row(int64_t y) const
+    {
+        return {cells_.data() + y * width_, static_cast<std::size_t>(width_)};
+    }
+
+    int64_t frames() const { return frames_; }
+
+    // How many tiles the game sent in the last frame rendered
+    int64_t last_frame_tiles() const { return last_frame_tiles_; }
+
+    double tiles_per_frame() const
+    {
+        return frames_ > 0 ? static_cast<double>(tiles_) / frames_ : 0.0;
+    }
+
+private:
+    void resize(int64_t width, int64_t height)
+    {
+        auto grow = [&](const std::vector<char>& old) {
+            std::vector<char> cells(width * height, ' ');
+            for (int64_t y = 0; y < height_; y++) {
+                nano::copy(old.begin() + y * width_, old.begin() + (y + 1) * width_,
+                           cells.begin() + y * width);
+            }
+            return cells;
+        };
+        cells_ = grow(cells_);
+        shown_ = grow(shown_);
+        width_ = width;
+        height_ = height;
+    }
+
+    int64_t width_ = 0;
+    int64_t height_ = 0;
+    std::vector<char> cells_;
+    // What the cells looked like when they were last rendered
+    std::vector<char> shown_;
+    std::vector<std::pair<int64_t, int64_t>> dirty_;
+    int64_t frame_tiles_ = 0;
+    int64_t last_frame_tiles_ = 0;
+    int64_t tiles_ = 0;
+    int64_t frames_ = 0;
+};
+
+// Displays are told about each score and tile as the game outputs it, and
+// end_frame() is called whenever the game wants input, which it does once
+// per frame, and when it's over
+
 struct curses_display {
 
-    explicit curses_display()
+    explicit curses_display(std::chrono::milliseconds frame_delay = {})
+        : frame_delay_(frame_delay)
     {
         // Initialise curses... I have no idea what most of this does
         initscr();
@@ -66,28 +157,275 @@ struct curses_display {
         endwin();
     }
 
-    void print_score(int score)
+    void print_score(int score) { screen_.score = score; }
+
+    void print_tile(int x, int y, tile_type t) { screen_.set_tile(x, y, t); }
+
+    // Draws whatever has changed since the last frame, and then slows
+    // things down a bit so we can watch
+    void end_frame()
     {
-        mvprintw(0, 0, fmt::format("Score: {}", score).c_str());
+        screen_.render([](int64_t x, int64_t y, char c) {
+            mvaddch(y + 1, x, static_cast<unsigned char>(c));
+        });
+
+        const std::chrono::duration<double> elapsed = clock_type::now() - start_;
+        const auto status = fmt::format("Score: {}   {:.0f} fps, {} tiles/frame ({:.1f} average)",
+                                        screen_.score, screen_.frames() / elapsed.count(),
+                                        screen_.last_frame_tiles(), screen_.tiles_per_frame());
+        mvaddstr(0, 0, status.c_str());
+        clrtoeol();
         refresh();
+
+        std::this_thread::sleep_for(frame_delay_);
     }
 
-    void print_tile(int x, int y, tile_type t)
+private:
+    using clock_type = std::chrono::steady_clock;
+
+    framebuffer screen_;
+    std::chrono::milliseconds frame_delay_;
+    clock_type::time_point start_ = clock_type::now();
+};
+
+// Draws nothing, unless asked to print each frame to stdout
+struct headless_display {
+
+    explicit headless_display(bool show_frames = false)
+        : show_frames_(show_frames)
+    {}
+
+    void print_score(int score) { screen_.score = score; }
+
+    void print_tile(int x, int y, tile_type t) { screen_.set_tile(x, y, t); }
+
+    void end_frame()
     {
-        mvaddch(y + 1, x, to_char(t));
-        refresh();
+        // There's nothing to draw, but this keeps the counts up to date
+        screen_.render([](int64_t, int64_t, char) {});
+        if (!show_frames_) {
+            return;
+        }
+        fmt::print("Score: {}   frame {}, {} tiles\n", screen_.score, screen_.frames(),
+                   screen_.last_frame_tiles());
+        for (int64_t y = 0; y < screen_.height(); y++) {
+            fmt::print("{}\n", screen_.row(y));
+        }
     }
+
+    const framebuffer& screen() const { return screen_; }
+
+private:
+    framebuffer screen_;
+    bool show_frames_;
 };
 
-auto run_game = [](auto prog, play_mode mode) {
-    prog[0] = 2;
-    auto vm = intcode{prog};
+// Moves the paddle to where the ball is going to land, working that out
+// from the last two places the ball was seen. The ball is assumed to bounce
+// only off the walls, so the guess is wrong if it hits a block on the way.
+struct paddle_controller {
 
-    curses_display display{};
+    constexpr void observe(int64_t x, int64_t y, tile_type t)
+    {
+        switch (t) {
+        case tile_type::wall:
+            left_ = nano::min(left_, x);
+            right_ = nano::max(right_, x);
+            top_ = nano::min(top_, y);
+            break;
+        case tile_type::paddle:
+            paddle_x_ = x;
+            paddle_y_ = y;
+            break;
+        case tile_type::ball:
+            if (seen_ball_) {
+                dx_ = x - ball_x_;
+                dy_ = y - ball_y_;
+            }
+            ball_x_ = x;
+            ball_y_ = y;
+            seen_ball_ = true;
+            if (landing()) {
+                has_target_ = false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
 
+    constexpr int decide() const
+    {
+        const auto diff = target() - paddle_x_;
+        return diff > 0 ? 1 : diff < 0 ? -1 : 0;
+    }
+
+    // Whether the ball is just above the paddle's row, on its way down
+    constexpr bool landing() const { return dy_ > 0 && ball_y_ == paddle_y_ - 1; }
+
+    // Overrides the guess until the ball next lands, once we know better
+    constexpr void set_target(int64_t x)
+    {
+        target_ = x;
+        has_target_ = true;
+    }
+
+    constexpr bool has_target() const { return has_target_; }
+
+    constexpr int64_t paddle_x() const { return paddle_x_; }
+
+    constexpr int64_t target() const { return has_target_ ? target_ : predict_landing(); }
+
+private:
+    constexpr int64_t predict_landing() const
+    {
+        if (dx_ == 0 || dy_ == 0 || paddle_y_ == 0 || right_ < left_) {
+            return ball_x_;
+        }
+
+        auto x = ball_x_, y = ball_y_, vx = dx_, vy = dy_;
+        // The ball can't take longer than this without going round in circles
+        const auto max_steps = 2 * (right_ - left_) * (paddle_y_ - top_);
+        for (int64_t i = 0; i < max_steps && !(vy > 0 && y == paddle_y_ - 1); i++) {
+            if (x + vx <= left_ || x + vx >= right_) {
+                vx = -vx;
+            }
+            if (y + vy <= top_) {
+                vy = -vy;
+            }
+            x += vx;
+            y += vy;
+        }
+        return x;
+    }
+
+    int64_t left_ = std::numeric_limits<int64_t>::max();
+    int64_t right_ = std::numeric_limits<int64_t>::min();
+    int64_t top_ = std::numeric_limits<int64_t>::max();
+    int64_t paddle_x_ = 0;
+    int64_t paddle_y_ = 0;
+    int64_t ball_x_ = 0;
+    int64_t ball_y_ = 0;
+    int64_t dx_ = 0;
+    int64_t dy_ = 0;
+    bool seen_ball_ = false;
+    int64_t target_ = 0;
+    bool has_target_ = false;
+};
+
+namespace test {
+
+// A controller which has seen an empty board, `width` by `height`, with
+// walls down the sides and across the top and the paddle at `paddle_x` on
+// the bottom row, and then the ball at (x0, y0) followed by (x1, y1)
+constexpr auto controller_on_board = [](int64_t width, int64_t height, int64_t paddle_x,
+                                        int64_t x0, int64_t y0, int64_t x1, int64_t y1) {
+    paddle_controller c;
+    for (int64_t y = 0; y < height; y++) {
+        c.observe(0, y, tile_type::wall);
+        c.observe(width - 1, y, tile_type::wall);
+    }
+    for (int64_t x = 0; x < width; x++) {
+        c.observe(x, 0, tile_type::wall);
+    }
+    c.observe(paddle_x, height - 1, tile_type::paddle);
+    c.observe(x0, y0, tile_type::ball);
+    c.observe(x1, y1, tile_type::ball);
+    return c;
+};
+
+// Straight down
+static_assert(controller_on_board(11, 9, 3, 3, 2, 4, 3).target() == 8);
+static_assert(controller_on_board(11, 9, 3, 3, 2, 4, 3).decide() == 1);
+// Off the right-hand wall
+static_assert(controller_on_board(11, 9, 3, 8, 2, 9, 3).target() == 5);
+// Off the top, then the right-hand wall
+static_assert(controller_on_board(11, 9, 7, 5, 3, 6, 2).target() == 5);
+static_assert(controller_on_board(11, 9, 7, 5, 3, 6, 2).decide() == -1);
+// Already there
+static_assert(controller_on_board(11, 9, 6, 7, 6, 6, 7).landing());
+static_assert(controller_on_board(11, 9, 6, 7, 6, 6, 7).decide() == 0);
+
+// A target, once set, wins until the ball lands
+constexpr auto with_target = [] {
+    auto c = controller_on_board(11, 9, 3, 3, 2, 4, 3);
+    c.set_target(2);
+    return c;
+};
+static_assert(with_target().target() == 2);
+static_assert(with_target().decide() == -1);
+
+}
+
+struct game_options {
+    play_mode mode = play_mode::cpu;
+    // Let the paddle_controller play the CPU's part, and skip the frames in
+    // between the ball's landings
+    bool predict = false;
+    // If given, the game is recorded here so that it can be replayed with
+    // the tool in intcode/replay
+    const char* trace_path = nullptr;
+    // If given, the game is saved here once the board has been drawn, and
+    // carries on from what was saved
+    const char* checkpoint_path = nullptr;
+};
+
+struct game_result {
     int64_t high_score = 0;
+    // How many times the game asked for input...
+    int64_t frames = 0;
+    // ...and how many of those the controller answered by itself, without
+    // them being drawn
+    int64_t skipped = 0;
+    // Frames which were run ahead and then thrown away, as the ball didn't
+    // go where the controller thought it would
+    int64_t wasted = 0;
+};
+
+// Saves `vm` as a checkpoint, and returns the VM loaded back from it, having
+// checked that it matches the one which was saved
+auto checkpoint_round_trip = [](const auto& vm, const char* path) {
+    aoc::save_checkpoint(vm, path);
+    auto restored = aoc::load_checkpoint<std::decay_t<decltype(vm)>>(path);
+
+    const auto before = vm.get_state();
+    const auto after = restored.get_state();
+    bool same = before.iptr == after.iptr && before.relbase == after.relbase &&
+                before.has_pending_input == after.has_pending_input &&
+                (!before.has_pending_input || before.pending_input == after.pending_input) &&
+                before.output == after.output && before.done == after.done &&
+                before.image_size == after.image_size;
+
+    // Pages which are all zero aren't saved, so we look both ways
+    auto compare_pages = [&same](const auto& from, const auto& to) {
+        from.memory().for_each_page([&](int64_t n, const aoc::paged_memory::page& p) {
+            for (std::size_t i = 0; i < p.size(); i++) {
+                same = same && to.peek(n * aoc::paged_memory::page_size + i) == p[i];
+            }
+        });
+    };
+    compare_pages(vm, restored);
+    compare_pages(restored, vm);
+
+    if (!same) {
+        aoc::throw_error("Checkpoint {} doesn't match the game it was saved from\n", path);
+    }
+    return restored;
+};
+
+auto run_game = [](auto prog, auto& display, const game_options& opts) {
+    prog[0] = 2;
+    auto vm = aoc::intcode{prog};
+
+    std::optional<aoc::trace_recorder> trace;
+    if (opts.trace_path) {
+        trace.emplace(prog);
+    }
+
+    game_result result;
     int64_t ball_x = 0;
     int64_t paddle_x = 0;
+    paddle_controller controller;
 
     const auto keyboard_input = [] {
         auto c = getch();
@@ -100,46 +438,170 @@ auto run_game = [](auto prog, play_mode mode) {
         }
     };
 
-    const auto cpu_input = [&ball_x, &paddle_x] {
-        // Slow things down a bit so we can watch
-        std::this_thread::sleep_for(std::chrono::milliseconds{17});
+    const auto cpu_input = [&] {
+        if (opts.predict) {
+            return controller.decide();
+        }
         const auto diff = ball_x - paddle_x;
         return diff > 0 ? 1 : diff < 0 ? -1 : 0;
     };
 
     const auto input_fn = [&] () -> std::function<int()> {
-        if (mode == play_mode::manual) {
+        if (opts.mode == play_mode::manual) {
             return keyboard_input;
         } else {
             return cpu_input;
         }
     }();
 
-    while (!vm.done()) {
-        const auto x = vm.next_output(input_fn);
-        const auto y = vm.next_output(input_fn);
-        const auto z = vm.next_output(input_fn);
+    // Outputs come in (x, y, tile) triples
+    auto read_triple = [](auto& triple, std::size_t& num_read, int64_t val) {
+        triple[num_read++] = val;
+        if (num_read < triple.size()) {
+            return false;
+        }
+        num_read = 0;
+        return true;
+    };
+
+    std::array<int64_t, 3> triple{};
+    std::size_t num_read = 0;
+
+    auto on_output = [&](int64_t val) {
+        if (trace) {
+            trace->output(val);
+        }
+        if (!read_triple(triple, num_read, val)) {
+            return;
+        }
+
+        const auto [x, y, z] = triple;
 
         if (x == -1 && y == 0) {
-            high_score = nano::max(high_score, z);
+            result.high_score = nano::max(result.high_score, z);
             display.print_score(z);
-            continue;
+            return;
         }
 
         const auto t = static_cast<tile_type>(z);
 
         if (t == tile_type::paddle) {
-            paddle_x= x;
+            paddle_x = x;
         }
 
         if (t == tile_type::ball) {
             ball_x = x;
         }
 
+        controller.observe(x, y, t);
         display.print_tile(x, y, t);
+    };
+
+    // With opts.predict, the controller plays on by itself, with nothing
+    // drawn, until the ball next comes down to the paddle. If the paddle
+    // isn't there to meet it (the ball having bounced off a block the
+    // controller didn't know about) the VM is put back how it was and this
+    // returns false, so that it can play again knowing where the ball will
+    // land. A snapshot of the VM is cheap, as it shares the pages of memory
+    // and the decoded instructions. Either way, the frames in between are
+    // skipped as far as the player and the display are concerned.
+    auto play_ahead = [&] {
+        const auto saved = vm;
+
+        auto ahead = controller;
+        auto ahead_triple = triple;
+        auto ahead_num_read = num_read;
+        std::vector<int64_t> outputs;
+        // Each input, and how many outputs came before it
+        std::vector<std::pair<std::size_t, int>> inputs;
+        bool landed = false;
+        int64_t landing_x = 0;
+
+        for (auto ev = vm.resume(); ev != aoc::event::halted; ev = vm.resume()) {
+            if (ev == aoc::event::output) {
+                outputs.push_back(vm.output());
+                if (read_triple(ahead_triple, ahead_num_read, vm.output())) {
+                    const auto [x, y, z] = ahead_triple;
+                    if (x != -1) {
+                        ahead.observe(x, y, static_cast<tile_type>(z));
+                        if (!landed && ahead.landing()) {
+                            landed = true;
+                            landing_x = x;
+                        }
+                    }
+                }
+            } else if (landed) {
+                break;
+            } else {
+                const auto val = ahead.decide();
+                vm.push_input(val);
+                inputs.emplace_back(outputs.size(), val);
+            }
+        }
+
+        // If we already knew where it would land, there's no point trying again
+        if (landed && landing_x != ahead.paddle_x() && !controller.has_target()) {
+            controller.set_target(landing_x);
+            vm = saved;
+            result.wasted += inputs.size();
+            return false;
+        }
+
+        std::size_t next = 0;
+        for (const auto& [before, val] : inputs) {
+            while (next < before) {
+                on_output(outputs[next++]);
+            }
+            if (trace) {
+                trace->input(val);
+            }
+        }
+        while (next < outputs.size()) {
+            on_output(outputs[next++]);
+        }
+        result.frames += inputs.size();
+        result.skipped += inputs.size();
+        return true;
+    };
+
+    for (auto ev = vm.resume(); ev != aoc::event::halted; ev = vm.resume()) {
+        if (ev == aoc::event::output) {
+            on_output(vm.output());
+            continue;
+        }
+
+        display.end_frame();
+
+        // The first time the game asks for input the board is all there, so
+        // that's the most useful place to pick it up again from
+        if (opts.checkpoint_path && result.frames == 0) {
+            vm = checkpoint_round_trip(vm, opts.checkpoint_path);
+        }
+
+        // The controller plays the frames in between landings by itself.
+        // After a wrong guess we're back at this frame, which has already
+        // been drawn, so it goes again straight away.
+        if (opts.predict && !controller.landing()) {
+            while (!play_ahead()) {}
+            continue;
+        }
+
+        const auto val = input_fn();
+        if (trace) {
+            trace->input(val);
+        }
+        vm.push_input(val);
+        ++result.frames;
+    }
+
+    // Show the final state of the screen
+    display.end_frame();
+
+    if (trace) {
+        trace->save(opts.trace_path);
     }
 
-    return high_score;
+    return result;
 };
 
 }
@@ -151,17 +613,44 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    const play_mode mode = [&] {
-        if (argc > 2 && argv[2] == std::string_view{"manual"}) {
-            return play_mode::manual;
+    game_options opts;
+    bool show_frames = false;
+    for (int i = 2; i < argc; i++) {
+        if (argv[i] == std::string_view{"manual"}) {
+            opts.mode = play_mode::manual;
+        } else if (argv[i] == std::string_view{"headless"}) {
+            opts.mode = play_mode::headless;
+        } else if (argv[i] == std::string_view{"--predict"}) {
+            opts.predict = true;
+        } else if (argv[i] == std::string_view{"--show-frames"}) {
+            show_frames = true;
+        } else if (argv[i] == std::string_view{"--record"} && i + 1 < argc) {
+            opts.trace_path = argv[++i];
+        } else if (argv[i] == std::string_view{"--checkpoint"} && i + 1 < argc) {
+            opts.checkpoint_path = argv[++i];
         }
-        return play_mode::cpu;
-    }();
+    }
+    // Nobody can predict what you're going to do
+    if (opts.mode == play_mode::manual) {
+        opts.predict = false;
+    }
 
-    const auto prog = load_program(argv[1]);
+    const auto prog = aoc::load_program(argv[1]);
 
     fmt::print("Number of block tiles (part one): {}\n", count_blocks(prog));
 
-    auto score = run_game(prog, mode);
-    fmt::print("Game over! score was {}\n", score);
-}
\ No newline at end of file
+    const auto result = [&] {
+        if (opts.mode == play_mode::headless) {
+            headless_display display{show_frames};
+            return run_game(prog, display, opts);
+        }
+        // The CPU is slowed down so we can watch; people are slow enough
+        curses_display display{std::chrono::milliseconds{opts.mode == play_mode::cpu ? 17 : 0}};
+        return run_game(prog, display, opts);
+    }();
+    fmt::print("Game over! score was {}\n", result.high_score);
+    if (opts.predict) {
+        fmt::print("{} frames, {} of them skipped ({} more run ahead and thrown away)\n",
+                   result.frames, result.skipped, result.wasted);
+    }
+}
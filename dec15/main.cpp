@@ -1,11 +1,9 @@
 
-#include "intcode.hpp"
+#include "../intcode/intcode.hpp"
 
 #include "../extern/fmt/ostream.h"
 
-#define PPCAT_IMPL(x, y) x ## y
-#define PPCAT(x, y) PPCAT_IMPL(x, y)
-#define _ PPCAT(unused, __COUNTER__)
+#include <deque>
 
 namespace {
 
@@ -23,16 +21,6 @@ auto directions = [] {
         });
 };
 
-direction reverse_dir(direction d)
-{
-    switch (d) {
-    case direction::north: return direction::south;
-    case direction::east: return direction::west;
-    case direction::south: return direction::north;
-    case direction::west: return direction::east;
-    }
-}
-
 enum class tile_type {
     unknown = -1,
     wall = 0,
@@ -75,55 +63,51 @@ auto print_map = [](const auto& map) {
     }
 };
 
-enum class mode {
-    solve,
-    map
-};
-
-auto map_room = [](const auto& prog, mode mode = mode::solve)
+// Explores the whole room breadth-first. Rather than moving a single droid
+// around (and backtracking), each position on the frontier keeps its own
+// snapshot of the VM, which is forked to try each direction. Since copies
+// share memory until they write to it, this is cheap.
+auto map_room = [](const auto& prog)
 {
-    auto vm = intcode{prog};
-
     std::map<position, tile_type> map{{{0, 0}, tile_type::empty}};
-    std::vector<direction> path;
-    position pos{0, 0};
-    direction dir = direction::north;
+    std::map<position, int> distance{{{0, 0}, 0}};
+    std::optional<position> goal;
 
-    while (true) {
-        auto surrounding_unknowns = nano::views::filter(directions(), [&](auto d) {
-            return map.find(adjacent(pos, d)) == map.end();
-        });
+    std::deque<std::pair<position, aoc::intcode<>>> queue;
+    queue.emplace_back(position{0, 0}, aoc::intcode{prog});
+
+    while (!queue.empty()) {
+        auto [pos, vm] = std::move(queue.front());
+        queue.pop_front();
 
-        if (!surrounding_unknowns.empty()) {
-            dir = *surrounding_unknowns.begin();
-            path.push_back(dir);
-        } else {
-            if (path.empty()) {
-                break;
+        for (auto dir : directions()) {
+            const auto next = adjacent(pos, dir);
+            if (map.find(next) != map.end()) {
+                continue;
             }
-            dir = reverse_dir(path.back());
-            path.pop_back();
-        }
 
-        auto in_fn = [&] { return static_cast<int64_t>(dir); };
+            auto droid = vm;
+            const auto tile = static_cast<tile_type>(
+                droid.run_until_output(static_cast<int64_t>(dir)));
+            map[next] = tile;
 
-        auto tile = static_cast<tile_type>(vm.next_output(in_fn));
+            if (tile == tile_type::wall) {
+                continue;
+            }
 
-        if (tile == tile_type::wall) {
-            path.pop_back();
-            map[adjacent(pos, dir)] = tile;
-            continue;
+            distance[next] = distance[pos] + 1;
+            if (tile == tile_type::goal) {
+                goal = next;
+            }
+            queue.emplace_back(next, std::move(droid));
         }
+    }
 
-        pos = adjacent(pos, dir);
-        map[pos] = tile;
-
-        if (tile == tile_type::goal && mode == mode::solve) {
-            break;
-        }
+    if (!goal) {
+        throw std::runtime_error("Could not find the oxygen system\n");
     }
 
-    return std::tuple(map, path.size(), pos);
+    return std::tuple(map, distance[*goal], *goal);
 };
 
 auto flood_oxygen = [](auto map, const position& start) {
@@ -169,14 +153,12 @@ int main(int argc, char** argv)
         return 1;
     }
 
-    const auto prog = load_program(argv[1]);
+    const auto prog = aoc::load_program(argv[1]);
 
-    auto [_, n_steps, goal_pos] = map_room(prog);
+    auto [map, n_steps, goal_pos] = map_room(prog);
 
     fmt::print("Took {} steps to reach the goal (part one)\n", n_steps);
 
-    auto [map, _,  _] = map_room(prog, mode::map);
-
     print_map(map);
 
     auto mins = flood_oxygen(map, goal_pos);
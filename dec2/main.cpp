@@ -1,33 +1,20 @@
 
-#include "../common.hpp"
+#include "../intcode/batch.hpp"
+
+#include <atomic>
+#include <exception>
+#include <thread>
 
 namespace {
 
 constexpr auto run_program = [](auto state) {
-    std::size_t pc = 0;
-
-    auto add = [&state] (int arg0, int arg1, int res) { state[res] = state[arg0] + state[arg1]; };
-    auto mult = [&state] (int arg0, int arg1, int res) { state[res] = state[arg0] * state[arg1]; };
-
-    while (true) {
-        const int opcode = state[pc];
-        switch (opcode) {
-        case 1: {
-            add(state[pc + 1], state[pc + 2], state[pc + 3]);
-            pc += 4;
-            break;
-        }
-        case 2:
-            mult(state[pc + 1], state[pc + 2], state[pc + 3]);
-            pc += 4;
-            break;
-        case 99:
-            return state;
-        default:
-            fmt::print("Error, got opcode {}\n", state[pc]);
-            return state;
-        }
+    auto vm = aoc::intcode{state};
+    vm.run([] { return int64_t{0}; }, [](int64_t) {});
+
+    for (std::size_t i = 0; i < state.size(); i++) {
+        state[i] = vm.peek(i);
     }
+    return state;
 };
 
 // Grr, std::array op== is not constexpr in C++17
@@ -46,16 +33,221 @@ constexpr auto run_program_with = [](auto state, int noun, int verb)
     return run_program(std::move(state));
 };
 
-auto read_input = [] (const char* path) {
-    std::ifstream stream(path);
-    std::vector<int> vec;
-    int i;
-    while (stream >> i) {
-        vec.push_back(i);
-        char c; // eat the comma
-        stream >> c;
+// A value of the form k + a*noun + b*verb + c*noun*verb, or one which we
+// can't work out without knowing the noun and verb
+struct bilinear {
+    int64_t k = 0, n = 0, v = 0, nv = 0;
+    bool known = true;
+
+    static constexpr bilinear unknown() { return {0, 0, 0, 0, false}; }
+
+    constexpr bool is_constant() const { return known && n == 0 && v == 0 && nv == 0; }
+
+    friend constexpr bilinear operator+(const bilinear& l, const bilinear& r)
+    {
+        if (!l.known || !r.known) {
+            return unknown();
+        }
+        return {l.k + r.k, l.n + r.n, l.v + r.v, l.nv + r.nv};
+    }
+
+    friend constexpr bilinear operator*(const bilinear& l, const bilinear& r)
+    {
+        if (!l.known || !r.known) {
+            return unknown();
+        }
+        // Anything with noun^2 or verb^2 terms is beyond us
+        if ((l.n != 0 || l.nv != 0) && (r.n != 0 || r.nv != 0)) {
+            return unknown();
+        }
+        if ((l.v != 0 || l.nv != 0) && (r.v != 0 || r.nv != 0)) {
+            return unknown();
+        }
+        return {l.k * r.k,
+                l.k * r.n + l.n * r.k,
+                l.k * r.v + l.v * r.k,
+                l.k * r.nv + l.n * r.v + l.v * r.n + l.nv * r.k};
+    }
+
+    friend constexpr bool operator==(const bilinear& l, const bilinear& r)
+    {
+        return l.known == r.known && l.k == r.k && l.n == r.n && l.v == r.v && l.nv == r.nv;
+    }
+};
+
+template <typename T, std::size_t N>
+constexpr auto symbolic_memory(const std::array<T, N>&) { return std::array<bilinear, N>{}; }
+
+template <typename T>
+auto symbolic_memory(const std::vector<T>& vec) { return std::vector<bilinear>(vec.size()); }
+
+// Day 2 programs only add and multiply, so we can run them once with the
+// noun and verb left as unknowns and get memory[0] in terms of them. Loads
+// through an address which depends on the noun or verb give an unknown value,
+// which is fine as long as it's overwritten before anyone uses it. Returns
+// nullopt if the program does anything else.
+constexpr auto run_symbolic = [](const auto& state) -> std::optional<bilinear>
+{
+    auto mem = symbolic_memory(state);
+    const auto size = static_cast<int64_t>(mem.size());
+    if (size < 3) {
+        return std::nullopt;
+    }
+    for (int64_t i = 0; i < size; i++) {
+        mem[i].k = state[i];
+    }
+    mem[1] = bilinear{0, 1, 0, 0};
+    mem[2] = bilinear{0, 0, 1, 0};
+
+    auto address = [&](int64_t i) -> std::optional<int64_t> {
+        if (i >= size || !mem[i].is_constant() ||
+            mem[i].k < 0 || mem[i].k >= size) {
+            return std::nullopt;
+        }
+        return mem[i].k;
+    };
+
+    auto load = [&](int64_t i) {
+        const auto addr = address(i);
+        return addr ? mem[*addr] : bilinear::unknown();
+    };
+
+    for (int64_t iptr = 0; iptr < size; iptr += 4) {
+        if (!mem[iptr].is_constant()) {
+            return std::nullopt;
+        }
+        const auto op = mem[iptr].k;
+        if (op == 99) {
+            return mem[0].known ? std::optional<bilinear>{mem[0]} : std::nullopt;
+        }
+        if (op != 1 && op != 2) {
+            return std::nullopt;
+        }
+        const auto dest = address(iptr + 3);
+        if (!dest) {
+            return std::nullopt;
+        }
+        mem[*dest] = op == 1 ? load(iptr + 1) + load(iptr + 2)
+                             : load(iptr + 1) * load(iptr + 2);
     }
-    return vec;
+    return std::nullopt;
+};
+
+static_assert(run_symbolic(std::array{1,0,0,0,1,1,2,0,99}) == bilinear{0, 1, 1, 0});
+static_assert(run_symbolic(std::array{1,0,0,0,2,1,2,0,99}) == bilinear{0, 0, 0, 1});
+static_assert(run_symbolic(std::array{1,0,0,3,2,1,13,3,1,3,2,0,99,5}) == bilinear{0, 5, 1, 0});
+// Unknown result
+static_assert(!run_symbolic(std::array{1,1,2,0,2,1,1,0,99}));
+// Stores through an unknown address
+static_assert(!run_symbolic(std::array{1,0,0,7,1,0,0,0,99}));
+// Not a day 2 program
+static_assert(!run_symbolic(std::array{1105,1,0,0,99}));
+
+// Solves expr == target for the first noun in [0, max_noun) and verb in
+// [0, max_verb), one noun at a time
+constexpr auto solve_for = [](const bilinear& expr, int64_t target,
+                              int max_noun = 100, int max_verb = 100)
+    -> std::optional<std::pair<int, int>>
+{
+    for (int noun = 0; noun < max_noun; noun++) {
+        // (v + nv * noun) * verb == target - k - n * noun
+        const int64_t coeff = expr.v + expr.nv * noun;
+        const int64_t rhs = target - expr.k - expr.n * noun;
+        if (coeff == 0) {
+            if (rhs == 0) {
+                return std::pair{noun, 0};
+            }
+        } else if (rhs % coeff == 0 && rhs / coeff >= 0 && rhs / coeff < max_verb) {
+            return std::pair{noun, static_cast<int>(rhs / coeff)};
+        }
+    }
+    return std::nullopt;
+};
+
+static_assert(solve_for(bilinear{3, 100, 1, 0}, 3 + 100 * 12 + 2) == std::pair{12, 2});
+static_assert(solve_for(bilinear{0, 0, 0, 1}, 7 * 11, 10, 20) == std::pair{7, 11});
+static_assert(solve_for(bilinear{0, 1, 0, 0}, 42) == std::pair{42, 0});
+static_assert(!solve_for(bilinear{0, 1, 1, 0}, 1000));
+
+// Searches nouns in [0, max_noun) and verbs in [0, max_verb) for a pair
+// which gives `target`, returning the first (in order of noun, then verb).
+// Pairs are handed out to every hardware thread a batch at a time, and each
+// thread reuses the same batch of VMs for all of its work. Threads stop
+// taking work once a pair has been found before any they have yet to try,
+// or once any of them has failed; the first error is rethrown at the end.
+auto find_noun_and_verb = [](const auto& prog, int64_t target,
+                             int max_noun = 100, int max_verb = 100)
+    -> std::optional<std::pair<int, int>>
+{
+    using batch_type = aoc::intcode_batch<>;
+    const int64_t num_pairs = int64_t{max_noun} * max_verb;
+    const auto num_threads = nano::max(std::thread::hardware_concurrency(), 1u);
+
+    std::atomic<int64_t> next_pair{0};
+    std::atomic<int64_t> found{num_pairs};
+    std::vector<std::exception_ptr> errors(num_threads);
+
+    auto worker = [&](unsigned idx) {
+        try {
+            batch_type batch{prog};
+
+            while (true) {
+                const auto first = next_pair.fetch_add(batch_type::lanes,
+                                                       std::memory_order_relaxed);
+                if (first >= found.load(std::memory_order_relaxed)) {
+                    break;
+                }
+
+                // Spare lanes at the end just repeat the last pair
+                auto pair_for = [&](std::size_t lane) {
+                    return nano::min(first + static_cast<int64_t>(lane), num_pairs - 1);
+                };
+
+                batch.reset(prog);
+                for (std::size_t lane = 0; lane < batch_type::lanes; lane++) {
+                    batch.poke(lane, 1, pair_for(lane) / max_verb);
+                    batch.poke(lane, 2, pair_for(lane) % max_verb);
+                }
+
+                batch.run([](std::size_t) { return int64_t{0}; }, [](std::size_t, int64_t) {});
+
+                for (std::size_t lane = 0; lane < batch_type::lanes; lane++) {
+                    if (batch.peek(lane, 0) == target) {
+                        // Keep whichever pair comes first
+                        auto pair = pair_for(lane);
+                        auto prev = found.load();
+                        while (pair < prev && !found.compare_exchange_weak(prev, pair)) {}
+                        break;
+                    }
+                }
+            }
+        } catch (...) {
+            errors[idx] = std::current_exception();
+            // Make the other threads give up too
+            next_pair = num_pairs;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (const auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+
+    const auto pair = found.load();
+    if (pair == num_pairs) {
+        return std::nullopt;
+    }
+    return std::pair(static_cast<int>(pair / max_verb), static_cast<int>(pair % max_verb));
 };
 
 }
@@ -67,19 +259,18 @@ int main(int argc, char** argv)
         return -1;
     }
 
-    const auto in = read_input(argv[1]);
+    const auto in = aoc::load_program(argv[1]);
 
     fmt::print("Part one: {}\n", run_program_with(in, 12, 2)[0]);
 
     constexpr int target = 19690720; // from problem description
 
-    for (int i : nano::views::iota(0, 100)) {
-        for (int j : nano::views::iota(0, 100)) {
-            if (run_program_with(in, i, j)[0] == target) {
-                fmt::print("Part two: {}\n", 100 * i + j);
-                return 0;
-            }
-        }
+    // Solve directly if we can, otherwise search
+    const auto expr = run_symbolic(in);
+    if (const auto answer = expr ? solve_for(*expr, target) : find_noun_and_verb(in, target)) {
+        const auto [noun, verb] = *answer;
+        fmt::print("Part two: {}\n", 100 * noun + verb);
+    } else {
+        fmt::print("Error, could not find part2 solution\n");
     }
-    fmt::print("Error, could not find part2 solution\n");
 }
\ No newline at end of file
@@ -1,76 +1,10 @@
 
-#include "../common.hpp"
+#include "../intcode/intcode.hpp"
 
 namespace {
 
-enum class param_mode : bool {
-    position,
-    immediate
-};
-
-constexpr auto decode_instruction = [](int in) {
-    int opcode = in % 100;
-    in /= 100;
-
-    std::array<param_mode, 3> modes{};
-    for (int i = 0; i < 3; i++) {
-        modes[i] = static_cast<param_mode>(in % 10);
-        in /= 10;
-    }
-    return std::pair(opcode, modes);
-};
-
-constexpr auto run_program = [](auto state, int in, auto out_fn) {
-    std::size_t iptr = 0;
-
-    while (iptr < state.size()) {
-        const auto [opcode, modes] = decode_instruction(state[iptr]);
-
-        auto arg = [modes = modes, iptr, &state] (int argnum) -> int& {
-            auto idx = iptr + argnum + 1;
-            return modes[argnum] == param_mode::position ? state[state[idx]] : state[idx];
-        };
-
-        switch (opcode) {
-        case 1:
-            arg(2) = arg(0) + arg(1);
-            iptr += 4;
-            break;
-        case 2:
-            arg(2) = arg(0) * arg(1);
-            iptr += 4;
-            break;
-        case 3:
-            arg(0) = in;
-            iptr += 2;
-            break;
-        case 4:
-            out_fn(arg(0));
-            iptr += 2;
-            break;
-        case 5:
-            iptr = arg(0) != 0 ? arg(1) : iptr + 3;
-            break;
-        case 6:
-            iptr = arg(0) == 0 ? arg(1) : iptr + 3;
-            break;
-        case 7:
-            arg(2) = arg(0) < arg(1) ? 1 : 0;
-            iptr += 4;
-            break;
-        case 8:
-            arg(2) = arg(0) == arg(1) ? 1 : 0;
-            iptr += 4;
-            break;
-        case 99:
-            return state;
-        default:
-            fmt::print(stderr, "Error, got unknown opcode {}\n", opcode);
-            return state;
-        }
-    }
-
-    return state;
+constexpr auto run_program = [](const auto& prog, int in, auto out_fn) {
+    aoc::intcode{prog}.run([in] { return in; }, out_fn);
 };
 
 // Test program for part 2, from the problem description
@@ -83,7 +17,7 @@ constexpr auto prog = std::array{
 
 constexpr auto run = [](auto& prog, int arg) {
     int out = 0;
-    run_program(prog, arg, [&out] (int i) { out = i; });
+    run_program(prog, arg, [&out] (int64_t i) { out = i; });
     return out;
 };
 
@@ -93,17 +27,6 @@ static_assert(run(prog, 9) == 1001);
 
 }
 
-auto read_input = [] (const char* path) {
-    std::ifstream stream(path);
-
-    return nano::istream_view<char>(stream)
-        | nano::views::split(nano::views::single(','))
-        | nano::views::transform([](auto rng) {
-            return std::stoi(aoc::to_string(rng));
-        })
-        | aoc::to_vector();
-};
-
 }
 
 int main(int argc, char** argv)
@@ -113,11 +36,11 @@ int main(int argc, char** argv)
         return -1;
     }
 
-    const auto in = read_input(argv[1]);
+    const auto in = aoc::load_program(argv[1]);
 
     auto collect_output = [] (auto& prog, int in_arg) {
-        std::vector<int> out;
-        run_program(prog, in_arg, [&out](int i) { out.push_back(i); });
+        std::vector<int64_t> out;
+        run_program(prog, in_arg, [&out](int64_t i) { out.push_back(i); });
         return out;
     };
 
@@ -125,7 +48,7 @@ int main(int argc, char** argv)
         // Part one
         const auto out = collect_output(in, 1);
 
-        if (nano::any_of(out.begin(), nano::prev(out.end()), [] (int i) { return i != 0; })) {
+        if (nano::any_of(out.begin(), nano::prev(out.end()), [] (int64_t i) { return i != 0; })) {
             fmt::print(stderr, "Boo, got test failure (part one) :-(\n");
             return -1;
         }
@@ -1,206 +1,286 @@
 
-#include "../common.hpp"
+#include "../intcode/batch.hpp"
+#include "../intcode/channel.hpp"
+
+#include <exception>
+#include <mutex>
 
 namespace {
 
-template <typename Memory>
-struct intcode {
+constexpr auto run_amplifier = [](const auto& prog, int64_t phase, int64_t input)
+{
+    auto inputs = std::array<int64_t, 2>{phase, input};
+    auto in_fn = [inputs, n = 0] () mutable {
+        return inputs.at(n++);
+    };
+    int64_t output = 0;
+    auto out_fn = [&output] (int64_t i) {
+        output = i;
+    };
 
-    constexpr explicit intcode(const Memory& memory)
-        : memory_(memory)
-    {}
+    auto vm = aoc::intcode{prog};
+    vm.run(in_fn, out_fn);
+    return output;
+};
 
-    template <typename In, typename Out>
-    constexpr auto run(In in_fn, Out out_fn)
-    {
-        while (!done_) {
-            process_next(in_fn, out_fn);
-        }
+// Returns the highest signal from any ordering of the amplifiers from `depth`
+// onwards, given the signal `input` coming out of the ones before. Each
+// amplifier's output depends only on those before it, so this visits each
+// distinct prefix of the permutations once: for five amplifiers that's 325
+// runs of a VM, rather than 600 to run all 120 permutations separately.
+template <typename Prog, typename Phases>
+constexpr int64_t max_signal_after(const Prog& prog, Phases& phases,
+                                   std::size_t depth, int64_t input)
+{
+    if (depth == phases.size()) {
+        return input;
     }
 
-    constexpr void run_until_input(int input)
-    {
-        if (done_) {
-            return;
-        }
+    int64_t max_signal = std::numeric_limits<int64_t>::min();
 
-        bool input_read = false;
+    for (std::size_t i = depth; i < phases.size(); i++) {
+        nano::swap(phases[depth], phases[i]);
+        const auto sig = run_amplifier(prog, phases[depth], input);
+        max_signal = nano::max(max_signal, max_signal_after(prog, phases, depth + 1, sig));
+        nano::swap(phases[depth], phases[i]);
+    }
 
-        auto in_fn = [&input_read, input] { input_read = true; return input; };
-        auto out_fn = [](int) {};
+    return max_signal;
+}
 
-        while (!input_read) {
-            process_next(in_fn, out_fn);
-        }
-    }
+constexpr auto run_all_permutations = [](const auto& prog)
+{
+    auto phases = std::array{0, 1, 2, 3, 4};
+    return max_signal_after(prog, phases, 0, 0);
+};
 
-    constexpr int run_until_output(int input)
-    {
-        if (done_) {
-            return input;
-        }
+// The same search as run_all_permutations, but a level of the tree at a
+// time: every amplifier at the same position in the chain is independent of
+// the others, so they can all be run together as batches
+auto batched_max_signal = [](const auto& prog, auto phases)
+{
+    using batch_type = aoc::intcode_batch<>;
 
-        auto in_fn = [input] { return input; };
-        bool have_output = false;
-        int output = 0;
+    struct prefix {
+        uint32_t used; // bitmask of indices into phases
+        int64_t signal;
+    };
 
-        auto out_fn = [&output, &have_output](int val) {
-            output = val;
-            have_output = true;
-        };
+    std::vector<prefix> level{{0, 0}};
+
+    for (std::size_t depth = 0; depth < phases.size(); depth++) {
+        // Each job extends a prefix with one of its unused phases
+        std::vector<std::pair<prefix, std::size_t>> jobs;
+        for (const auto& p : level) {
+            for (std::size_t i = 0; i < phases.size(); i++) {
+                if ((p.used & (1u << i)) == 0) {
+                    jobs.emplace_back(p, i);
+                }
+            }
+        }
 
-        while(!done_ && !have_output) {
-            process_next(in_fn, out_fn);
+        std::vector<prefix> next(jobs.size());
+
+        for (std::size_t first = 0; first < jobs.size(); first += batch_type::lanes) {
+            // Spare lanes at the end just repeat the last job
+            auto job_for = [&](std::size_t lane) {
+                return nano::min(first + lane, jobs.size() - 1);
+            };
+
+            std::array<int, batch_type::lanes> inputs_read{};
+            auto in_fn = [&](std::size_t lane) -> int64_t {
+                const auto& [p, i] = jobs[job_for(lane)];
+                return inputs_read[lane]++ == 0 ? phases[i] : p.signal;
+            };
+            auto out_fn = [&](std::size_t lane, int64_t val) {
+                const auto& [p, i] = jobs[job_for(lane)];
+                next[job_for(lane)] = prefix{p.used | (1u << i), val};
+            };
+
+            batch_type{prog}.run(in_fn, out_fn);
         }
 
-        return have_output ? output : input;
+        level = std::move(next);
     }
 
-    constexpr bool done() const { return done_; }
+    return nano::max(level | nano::views::transform(&prefix::signal));
+};
 
-private:
-    template <typename In, typename Out>
-    constexpr void process_next(In& in_fn, Out& out_fn)
-    {
-        const auto [opcode, modes] = decode_instruction(memory_[iptr_]);
+template <typename Prog, std::size_t... I>
+constexpr auto make_amps(const Prog& prog, std::index_sequence<I...>)
+{
+    return std::array{(static_cast<void>(I), aoc::intcode{prog})...};
+}
 
-        auto arg = [this, modes = modes] (int argnum) -> int& {
-            auto idx = iptr_ + argnum + 1;
-            return modes[argnum] == param_mode::position ? memory_[memory_[idx]] : memory_[idx];
-        };
+constexpr auto run_amps_with_feedback = [](const auto& prog, const auto phases)
+{
+    constexpr std::size_t num_amps = std::tuple_size_v<decltype(phases)>;
+    auto vms = make_amps(prog, std::make_index_sequence<num_amps>{});
 
-        switch (opcode) {
-        case 1:
-            arg(2) = arg(0) + arg(1);
-            iptr_ += 4;
-            break;
-        case 2:
-            arg(2) = arg(0) * arg(1);
-            iptr_ += 4;
-            break;
-        case 3:
-            arg(0) = in_fn();
-            iptr_ += 2;
-            break;
-        case 4:
-            out_fn(arg(0));
-            iptr_ += 2;
-            break;
-        case 5:
-            iptr_ = arg(0) != 0 ? arg(1) : iptr_ + 3;
-            break;
-        case 6:
-            iptr_ = arg(0) == 0 ? arg(1) : iptr_ + 3;
-            break;
-        case 7:
-            arg(2) = arg(0) < arg(1) ? 1 : 0;
-            iptr_ += 4;
-            break;
-        case 8:
-            arg(2) = arg(0) == arg(1) ? 1 : 0;
-            iptr_ += 4;
-            break;
-        case 99:
-            done_ = true;
-            break;
-        default:
-            throw std::runtime_error{fmt::format("Error, got unknown opcode {}\n", opcode)};
-        }
+    // Initial setup
+    for (std::size_t i = 0; i < num_amps; i++) {
+        vms[i].feed(phases[i]);
     }
 
-    enum class param_mode : bool {
-        position,
-        immediate
-    };
-
-    static constexpr auto decode_instruction(int in) {
-        int opcode = in % 100;
-        in /= 100;
+    // Run loop
+    int64_t next_input = 0;
+    std::size_t next_vm = 0;
 
-        std::array<param_mode, 3> modes{};
-        for (int i = 0; i < 3; i++) {
-            modes[i] = static_cast<param_mode>(in % 10);
-            in /= 10;
-        }
-        return std::pair(opcode, modes);
-    };
+    while (!vms.back().done()) {
+        next_input = vms[next_vm].run_until_output(next_input);
+        next_vm = (next_vm + 1) % num_amps;
+    }
 
-    Memory memory_;
-    int iptr_ = 0;
-    bool done_ = false;
+    return next_input;
 };
 
-constexpr auto run_amplifiers = [](const auto& prog, auto phases)
+// Like run_amps_with_feedback, but every amplifier gets a thread of its own,
+// and passes its outputs to the next through a channel. This lets any number
+// of amplifiers compute at the same time, rather than one at a time.
+auto run_amps_pipelined = [](const auto& prog, const auto& phases)
 {
-    auto next_input = 0;
-
-    for (auto i : nano::views::iota(0, 5)) {
-        auto inputs = std::array{phases[i], next_input};
-        auto in_fn = [inputs, n = 0] () mutable {
-            return inputs.at(n++);
-        };
-        auto out_fn = [&next_input] (int i) {
-            next_input = i;
-        };
+    const std::size_t num_amps = phases.size();
 
-        auto vm = intcode{prog};
-        vm.run(in_fn, out_fn);
+    // Channel i carries signals into amplifier i, starting with its phase
+    std::vector<aoc::spsc_channel<int64_t>> channels(num_amps);
+    for (std::size_t i = 0; i < num_amps; i++) {
+        channels[i].push(phases[i]);
     }
+    channels[0].push(0);
+
+    int64_t last_signal = 0;
+    std::exception_ptr error;
+    std::once_flag error_flag;
+
+    auto run_stage = [&](std::size_t i) {
+        auto& input = channels[i];
+        auto& output = channels[(i + 1) % num_amps];
+
+        auto in_fn = input.reader();
+        auto out_fn = [&, write = output.writer()] (int64_t val) {
+            write(val);
+            if (i == num_amps - 1) {
+                last_signal = val;
+            }
+        };
 
-    return next_input;
-};
-
-constexpr auto run_all_permutations = [](const auto& prog)
-{
-    auto phases = std::array{0, 1, 2, 3, 4};
+        try {
+            aoc::intcode{prog}.run(in_fn, out_fn);
+        } catch (...) {
+            // Only the first error is interesting: the rest just come from
+            // the other stages noticing this one has gone
+            std::call_once(error_flag, [&] { error = std::current_exception(); });
+            input.close();
+        }
+        output.close();
+    };
 
-    int max_signal = 0;
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < num_amps; i++) {
+        threads.emplace_back(run_stage, i);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
 
-    do {
-        auto sig = run_amplifiers(prog, phases);
-        max_signal = nano::max(sig, max_signal);
-    } while (nano::next_permutation(phases).found);
+    if (error) {
+        std::rethrow_exception(error);
+    }
 
-    return max_signal;
+    return last_signal;
 };
 
-constexpr auto run_amps_with_feedback = [](const auto& prog, const auto phases)
+constexpr int64_t factorial(std::size_t n)
 {
-    auto vms = std::array{intcode{prog}, intcode{prog}, intcode{prog}, intcode{prog}, intcode{prog}};
-
-    // Initial setup
-    for (int i = 0; i < 5; i++) {
-        vms[i].run_until_input(phases[i]);
-    }
-
-    // Run loop
-    int next_input = 0;
-    int next_vm = 0;
+    return n < 2 ? 1 : n * factorial(n - 1);
+}
 
-    while (!vms.back().done()) {
-        next_input = vms[next_vm].run_until_output(next_input);
-        next_vm = (next_vm + 1) % 5;
+// Returns the nth lexicographic permutation of the sorted array `phases`
+template <typename Phases>
+constexpr Phases nth_permutation(Phases phases, int64_t n)
+{
+    // Each digit of n in the factorial number system picks which of the
+    // remaining phases comes next
+    for (std::size_t i = 0; i + 1 < phases.size(); i++) {
+        const auto block = factorial(phases.size() - i - 1);
+        auto j = i + n / block;
+        n %= block;
+        for (; j > i; j--) {
+            const auto tmp = phases[j];
+            phases[j] = phases[j - 1];
+            phases[j - 1] = tmp;
+        }
     }
+    return phases;
+}
 
-    return next_input;
-};
-
-constexpr auto run_all_permutations_with_feedback = [](const auto& prog)
+// Runs `run_amps(prog, phases)` for every permutation of `phases`, spread
+// across all available hardware threads, and returns the highest signal.
+// Threads grab permutations in chunks, so that 8! or 10! orderings of a long
+// chain of amplifiers don't spend their time contending over the counter.
+auto parallel_max_signal = [](const auto& prog, auto phases, auto run_amps)
 {
-    auto phases = std::array{5, 6, 7, 8, 9};
+    constexpr int64_t chunk_size = 32;
+
+    nano::sort(phases);
+    const int64_t num_perms = factorial(phases.size());
+    const auto num_threads = nano::max(std::thread::hardware_concurrency(), 1u);
+
+    std::atomic<int64_t> next_perm{0};
+    std::vector<int64_t> max_signals(num_threads, std::numeric_limits<int64_t>::min());
+    std::vector<std::exception_ptr> errors(num_threads);
+
+    auto worker = [&](unsigned idx) {
+        int64_t max_signal = max_signals[idx];
+
+        try {
+            while (true) {
+                const auto first = next_perm.fetch_add(chunk_size, std::memory_order_relaxed);
+                if (first >= num_perms) {
+                    break;
+                }
+
+                auto perm = nth_permutation(phases, first);
+                const auto last = nano::min(first + chunk_size, num_perms);
+                for (auto i = first; i < last; i++) {
+                    max_signal = nano::max(max_signal, int64_t{run_amps(prog, perm)});
+                    nano::next_permutation(perm);
+                }
+            }
+        } catch (...) {
+            errors[idx] = std::current_exception();
+            // Make the other threads give up too
+            next_perm = num_perms;
+        }
 
-    int max_signal = 0;
+        max_signals[idx] = max_signal;
+    };
 
-    do {
-        auto sig = run_amps_with_feedback(prog, phases);
-        max_signal = nano::max(sig, max_signal);
-    } while (nano::next_permutation(phases).found);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
 
-    return max_signal;
+    for (const auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+
+    return nano::max(max_signals);
 };
 
 namespace test {
 
+static_assert(nano::equal(nth_permutation(std::array{0, 1, 2, 3}, 0), std::array{0, 1, 2, 3}));
+static_assert(nano::equal(nth_permutation(std::array{0, 1, 2, 3}, 1), std::array{0, 1, 3, 2}));
+static_assert(nano::equal(nth_permutation(std::array{0, 1, 2, 3}, 9), std::array{1, 2, 3, 0}));
+static_assert(nano::equal(nth_permutation(std::array{0, 1, 2, 3}, 23), std::array{3, 2, 1, 0}));
+
 constexpr auto prog1 = std::array{3,15,3,16,1002,16,10,16,1,16,15,15,4,15,99,0,0};
 static_assert(run_all_permutations(prog1) == 43210);
 
@@ -223,24 +303,33 @@ static_assert(run_amps_with_feedback(prog5, std::array{9, 7, 8, 5, 6}) == 18216)
 
 }
 
-auto read_input = [] (const char* path) {
-    std::ifstream stream(path);
-
-    return nano::istream_view<char>(stream)
-        | nano::views::split(nano::views::single(','))
-        | nano::views::transform([](auto rng) {
-            return std::stoi(aoc::to_string(rng));
-        })
-        | aoc::to_vector();
-};
-
 }
 
 int main(int argc, char** argv)
 {
-    const auto prog = read_input(argv[1]);
+    if (argc < 2) {
+        fmt::print(stderr, "No input!\n");
+        return 1;
+    }
 
-    fmt::print("Highest signal (part one): {}\n", run_all_permutations(prog));
+    const auto prog = aoc::load_program(argv[1]);
+
+    fmt::print("Highest signal (part one): {}\n",
+               batched_max_signal(prog, std::array{0, 1, 2, 3, 4}));
+
+    // In pipeline mode each run of the amplifiers already uses a thread per
+    // amplifier, so the permutations are tried one after another
+    const auto max_signal = [&] {
+        if (argc > 2 && argv[2] == std::string_view{"pipeline"}) {
+            auto phases = std::array{5, 6, 7, 8, 9};
+            int64_t max_signal = 0;
+            do {
+                max_signal = nano::max(max_signal, run_amps_pipelined(prog, phases));
+            } while (nano::next_permutation(phases).found);
+            return max_signal;
+        }
+        return parallel_max_signal(prog, std::array{5, 6, 7, 8, 9}, run_amps_with_feedback);
+    }();
 
-    fmt::print("Highest signal with feedback (part two): {}\n", run_all_permutations_with_feedback(prog));
+    fmt::print("Highest signal with feedback (part two): {}\n", max_signal);
 }
\ No newline at end of file
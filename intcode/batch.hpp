@@ -0,0 +1,313 @@
+#ifndef ADVENT_OF_CODE_2019_INTCODE_BATCH_HPP
+#define ADVENT_OF_CODE_2019_INTCODE_BATCH_HPP
+
+#include "intcode.hpp"
+
+#include <optional>
+
+namespace aoc {
+
+// Runs many copies of a program side by side, for sweeping over inputs. The
+// copies ("lanes") share an instruction pointer, and memory is laid out with
+// the lanes of each word next to each other, so each instruction is decoded
+// once and then carried out by loops over the lanes, which the compiler can
+// vectorise (e.g. with -O3 -mavx2).
+//
+// A lane drops out of the batch when it would do something different from
+// the others: run a different instruction, jump somewhere else, or touch
+// memory beyond the end of the program. It then carries on in a VM of its
+// own, once the rest of the batch has finished.
+template <std::size_t Lanes = 16>
+class intcode_batch {
+public:
+    static constexpr std::size_t lanes = Lanes;
+
+    // Every lane starts with a copy of `prog`
+    template <typename Program>
+    explicit intcode_batch(const Program& prog)
+    {
+        reset(prog);
+    }
+
+    // Starts again with every lane holding a fresh copy of `prog`, reusing
+    // the memory already allocated
+    template <typename Program>
+    void reset(const Program& prog)
+    {
+        size_ = nano::distance(prog);
+        mem_.resize(size_ * Lanes);
+        int64_t addr = 0;
+        for (const auto& word : prog) {
+            std::fill_n(row(addr++), Lanes, word);
+        }
+
+        iptr_ = 0;
+        relbase_ = {};
+        active_.fill(true);
+        done_ = {};
+        for (auto& vm : scalar_) {
+            vm.reset();
+        }
+    }
+
+    int64_t peek(std::size_t lane, int64_t addr) const
+    {
+        if (scalar_[lane]) {
+            return scalar_[lane]->peek(addr);
+        }
+        return in_range(addr) ? row(addr)[lane] : 0;
+    }
+
+    void poke(std::size_t lane, int64_t addr, int64_t val)
+    {
+        if (!scalar_[lane] && !in_range(addr)) {
+            leave_batch(lane, iptr_);
+        }
+        if (scalar_[lane]) {
+            scalar_[lane]->poke(addr, val);
+        } else {
+            row(addr)[lane] = val;
+        }
+    }
+
+    bool done(std::size_t lane) const
+    {
+        return scalar_[lane] ? scalar_[lane]->done() : done_[lane];
+    }
+
+    // Runs every lane until it halts. The I/O functions are called as
+    // in_fn(lane) and out_fn(lane, val).
+    template <typename In, typename Out>
+    void run(In in_fn, Out out_fn)
+    {
+        while (true) {
+            const auto num_active = nano::count(active_, true);
+            if (num_active == 0) {
+                break;
+            }
+            // Stepping a nearly-empty batch is slower than running its lanes
+            // separately
+            if (num_active < min_active) {
+                for (std::size_t lane = 0; lane < Lanes; lane++) {
+                    if (active_[lane]) {
+                        leave_batch(lane, iptr_);
+                    }
+                }
+                break;
+            }
+            step(static_cast<std::size_t>(nano::find(active_, true) - active_.begin()),
+                 in_fn, out_fn);
+        }
+
+        for (std::size_t lane = 0; lane < Lanes; lane++) {
+            if (scalar_[lane]) {
+                scalar_[lane]->run([&] { return int64_t{in_fn(lane)}; },
+                                   [&](int64_t val) { out_fn(lane, val); });
+            }
+        }
+    }
+
+private:
+    static constexpr std::ptrdiff_t min_active = nano::max(std::size_t{1}, Lanes / 4);
+
+    using lane_values = std::array<int64_t, Lanes>;
+
+    int64_t* row(int64_t addr) { return mem_.data() + addr * Lanes; }
+    const int64_t* row(int64_t addr) const { return mem_.data() + addr * Lanes; }
+
+    bool in_range(int64_t addr) const
+    {
+        return static_cast<uint64_t>(addr) < static_cast<uint64_t>(size_);
+    }
+
+    // Hands a lane over to a VM of its own, which will start at `iptr`
+    void leave_batch(std::size_t lane, int64_t iptr)
+    {
+        std::vector<int64_t> image(size_);
+        for (int64_t addr = 0; addr < size_; addr++) {
+            image[addr] = row(addr)[lane];
+        }
+        scalar_[lane].emplace(image);
+        scalar_[lane]->jump(iptr, relbase_[lane]);
+        active_[lane] = false;
+    }
+
+    template <typename In, typename Out>
+    void step(std::size_t lead, In& in_fn, Out& out_fn)
+    {
+        // After running off the end of the program, everyone goes their own
+        // way so that the interpreter reports the error
+        if (!in_range(iptr_)) {
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane]) {
+                    leave_batch(lane, iptr_);
+                }
+            }
+            return;
+        }
+
+        const auto iptr = iptr_;
+        const auto word = row(iptr)[lead];
+
+        // Lanes which have modified this instruction go their own way. So
+        // does everyone if it's invalid or runs off the end of memory, so
+        // that the interpreter reports the error.
+        const bool valid = is_valid_instruction(word) &&
+            in_range(iptr + num_params(decode_instruction(word).op));
+        for (std::size_t lane = 0; lane < Lanes; lane++) {
+            if (active_[lane] && (!valid || row(iptr)[lane] != word)) {
+                leave_batch(lane, iptr);
+            }
+        }
+        if (!valid || !active_[lead]) {
+            return;
+        }
+
+        const auto insn = decode_instruction(word);
+        const int nparams = num_params(insn.op);
+
+        // Work out the address of each operand (if it has one) in each lane
+        std::array<lane_values, 3> addrs{};
+        for (int i = 0; i < nparams; i++) {
+            const auto* operand = row(iptr + i + 1);
+            switch (insn.modes[i]) {
+            case param_mode::position:
+                std::copy_n(operand, Lanes, addrs[i].begin());
+                break;
+            case param_mode::immediate:
+                std::fill(addrs[i].begin(), addrs[i].end(), iptr + i + 1);
+                break;
+            case param_mode::relative:
+                for (std::size_t lane = 0; lane < Lanes; lane++) {
+                    addrs[i][lane] = relbase_[lane] + operand[lane];
+                }
+                break;
+            }
+
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane] && !in_range(addrs[i][lane])) {
+                    leave_batch(lane, iptr);
+                }
+            }
+        }
+        if (!active_[lead]) {
+            return;
+        }
+
+        auto get = [&](int i) {
+            lane_values vals{};
+            const auto& a = addrs[i];
+            // Usually every lane reads from the same address, so the values
+            // are all next to each other
+            bool same = true;
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                same &= !active_[lane] || a[lane] == a[lead];
+            }
+            if (same) {
+                std::copy_n(row(a[lead]), Lanes, vals.begin());
+            } else {
+                for (std::size_t lane = 0; lane < Lanes; lane++) {
+                    vals[lane] = in_range(a[lane]) ? row(a[lane])[lane] : 0;
+                }
+            }
+            return vals;
+        };
+
+        auto set = [&](int i, const lane_values& vals) {
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane]) {
+                    row(addrs[i][lane])[lane] = vals[lane];
+                }
+            }
+        };
+
+        auto binary_op = [&](auto op) {
+            const auto a = get(0);
+            const auto b = get(1);
+            lane_values res{};
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                res[lane] = op(a[lane], b[lane]);
+            }
+            set(2, res);
+        };
+
+        auto jump_if = [&](bool nonzero) {
+            const auto cond = get(0);
+            const auto target = get(1);
+            auto next = [&](std::size_t lane) {
+                return (cond[lane] != 0) == nonzero ? target[lane] : iptr + 3;
+            };
+            iptr_ = next(lead);
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane] && (next(lane) != iptr_ || !in_range(next(lane)))) {
+                    leave_batch(lane, next(lane));
+                }
+            }
+        };
+
+        switch (insn.op) {
+        case opcode::add:
+            binary_op([](int64_t a, int64_t b) { return a + b; });
+            break;
+        case opcode::mul:
+            binary_op([](int64_t a, int64_t b) { return a * b; });
+            break;
+        case opcode::lt:
+            binary_op([](int64_t a, int64_t b) { return int64_t{a < b}; });
+            break;
+        case opcode::eq:
+            binary_op([](int64_t a, int64_t b) { return int64_t{a == b}; });
+            break;
+        case opcode::in: {
+            lane_values vals{};
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane]) {
+                    vals[lane] = in_fn(lane);
+                }
+            }
+            set(0, vals);
+            break;
+        }
+        case opcode::out: {
+            const auto vals = get(0);
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                if (active_[lane]) {
+                    out_fn(lane, vals[lane]);
+                }
+            }
+            break;
+        }
+        case opcode::jnz:
+            return jump_if(true);
+        case opcode::jz:
+            return jump_if(false);
+        case opcode::rbo: {
+            const auto vals = get(0);
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                relbase_[lane] += vals[lane];
+            }
+            break;
+        }
+        case opcode::halt:
+            for (std::size_t lane = 0; lane < Lanes; lane++) {
+                done_[lane] = done_[lane] || active_[lane];
+                active_[lane] = false;
+            }
+            return;
+        }
+
+        iptr_ += nparams + 1;
+    }
+
+    int64_t size_ = 0;
+    std::vector<int64_t> mem_;
+    int64_t iptr_ = 0;
+    lane_values relbase_{};
+    std::array<bool, Lanes> active_{};
+    std::array<bool, Lanes> done_{};
+    std::array<std::optional<intcode<>>, Lanes> scalar_{};
+};
+
+} // namespace aoc
+
+#endif
@@ -0,0 +1,117 @@
+
+#include "../intcode.hpp"
+
+// Times the shared Intcode VM on a program from one of the days, once with
+// each dispatch method. Inputs given on the command line are fed to the
+// program in order; once they run out, the last one is repeated (or zero if
+// there were none). If compiled with -DAOC_INTCODE_PROFILE, it then prints
+// a profile of one run of the program.
+//
+// Given a binary image (see intcode/image), each run makes its VM straight
+// from the mapped image, starting with the image's decoded instructions, so
+// the timings include that start-up.
+//
+// Usage: ./main input.txt [iterations] [inputs...]
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+template <typename VM>
+auto run_once(VM& vm, const std::vector<int64_t>& inputs)
+{
+    std::size_t n = 0;
+    int64_t num_outputs = 0;
+    int64_t last_output = 0;
+
+    auto in_fn = [&] {
+        if (inputs.empty()) {
+            return int64_t{0};
+        }
+        return inputs[nano::min(n++, inputs.size() - 1)];
+    };
+
+    auto out_fn = [&](int64_t val) {
+        ++num_outputs;
+        last_output = val;
+    };
+
+    vm.run(in_fn, out_fn);
+
+    return std::pair(num_outputs, last_output);
+}
+
+template <typename VM>
+VM make_vm(const std::vector<int64_t>& prog)
+{
+    return VM{prog};
+}
+
+template <typename VM>
+VM make_vm(const aoc::program_image& image)
+{
+    return image.make_vm<VM>();
+}
+
+template <aoc::dispatch Dispatch, typename Source>
+auto run_once(const Source& prog, const std::vector<int64_t>& inputs)
+{
+    auto vm = make_vm<aoc::intcode<aoc::default_memory, Dispatch>>(prog);
+    return run_once(vm, inputs);
+}
+
+template <aoc::dispatch Dispatch, typename Source>
+void benchmark(const char* name, const Source& prog,
+               const std::vector<int64_t>& inputs, int iterations)
+{
+    std::vector<double> timings;
+    std::pair<int64_t, int64_t> result{};
+
+    for (int i = 0; i < iterations; i++) {
+        const auto start = clock_type::now();
+        result = run_once<Dispatch>(prog, inputs);
+        const auto end = clock_type::now();
+        timings.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+
+    nano::sort(timings);
+    const auto mean = aoc::accumulate(timings, 0.0) / timings.size();
+
+    fmt::print("{}: {} outputs, last output {}\n", name, result.first, result.second);
+    fmt::print("{}: {} runs: min {:.1f}us, median {:.1f}us, mean {:.1f}us\n",
+               name, iterations, timings.front(), timings[timings.size() / 2], mean);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fmt::print(stderr, "Usage: {} input.txt [iterations] [inputs...]\n", argv[0]);
+        return 1;
+    }
+
+    const int iterations = argc > 2 ? std::stoi(argv[2]) : 100;
+    std::vector<int64_t> inputs;
+    for (int i = 3; i < argc; i++) {
+        inputs.push_back(std::stoll(argv[i]));
+    }
+
+    auto run_all = [&](const auto& prog) {
+        benchmark<aoc::dispatch::switched>("switch", prog, inputs, iterations);
+        benchmark<aoc::dispatch::threaded>("threaded", prog, inputs, iterations);
+
+#ifdef AOC_INTCODE_PROFILE
+        auto vm = make_vm<aoc::intcode<>>(prog);
+        run_once(vm, inputs);
+        fmt::print("\nProfile:\n");
+        vm.profile().print(stdout);
+#endif
+    };
+
+    if (aoc::is_program_image(aoc::mapped_file(argv[1]).view())) {
+        run_all(aoc::program_image(argv[1]));
+    } else {
+        run_all(aoc::load_program(argv[1]));
+    }
+}
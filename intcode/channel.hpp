@@ -0,0 +1,121 @@
+#ifndef ADVENT_OF_CODE_2019_INTCODE_CHANNEL_HPP
+#define ADVENT_OF_CODE_2019_INTCODE_CHANNEL_HPP
+
+#include "intcode.hpp"
+
+#include <atomic>
+#include <optional>
+#include <thread>
+
+namespace aoc {
+
+// A bounded queue for passing values from one thread to another. Exactly one
+// thread may push and exactly one other thread may pop; neither takes a lock.
+//
+// push() and pop() wait (spinning, then yielding) while the queue is full or
+// empty respectively, whereas try_push() and try_pop() return immediately.
+// reader() and writer() adapt the channel for use as an Intcode VM's input
+// and output functions.
+//
+// Either side may close() the channel. Once it is closed, pushing throws, and
+// popping throws as soon as the values already in the queue have been read.
+// This stops a VM which is waiting on a peer that has gone away.
+template <typename T, std::size_t Capacity = 64>
+class spsc_channel {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Channel capacity must be a power of two");
+
+public:
+    void push(T val)
+    {
+        wait([&] { return try_push(val); });
+    }
+
+    T pop()
+    {
+        std::optional<T> val;
+        wait([&] { return (val = try_pop()).has_value(); });
+        return std::move(*val);
+    }
+
+    // Returns false if the channel is full
+    bool try_push(T& val)
+    {
+        if (closed()) {
+            throw_error("Push to a closed channel");
+        }
+
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+
+        buffer_[tail % Capacity] = std::move(val);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns nothing if the channel is empty
+    std::optional<T> try_pop()
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (tail_.load(std::memory_order_acquire) == head) {
+            // The producer may have pushed its last value just before
+            // closing, so look again once we've seen the channel closed
+            if (!closed()) {
+                return std::nullopt;
+            }
+            if (tail_.load(std::memory_order_acquire) == head) {
+                throw_error("Pop from a closed, empty channel");
+            }
+        }
+
+        std::optional<T> val{std::move(buffer_[head % Capacity])};
+        head_.store(head + 1, std::memory_order_release);
+        return val;
+    }
+
+    // An input function which waits for the next value
+    auto reader() { return [this] { return pop(); }; }
+
+    // An input function which never waits, returning `if_empty` when there is
+    // nothing to read
+    auto reader(T if_empty)
+    {
+        return [this, if_empty] { return try_pop().value_or(if_empty); };
+    }
+
+    // An output function which waits for room in the channel
+    auto writer() { return [this] (T val) { push(std::move(val)); }; }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+    // Waits until `done()` returns true. A closed channel makes the try_
+    // functions throw, so this can't wait forever on a peer that has gone.
+    template <typename Done>
+    static void wait(Done done)
+    {
+        for (int spins = 0; !done(); ) {
+            if (spins < 64) {
+                spins++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // The indices only ever increase, and are reduced modulo the capacity
+    // when they are used. Each lives on its own cache line, so that the two
+    // sides don't fight over them.
+    alignas(64) std::atomic<std::size_t> head_{0}; // written by the consumer
+    alignas(64) std::atomic<std::size_t> tail_{0}; // written by the producer
+    alignas(64) std::atomic<bool> closed_{false};
+    std::array<T, Capacity> buffer_{};
+};
+
+} // namespace aoc
+
+#endif
@@ -0,0 +1,35 @@
+
+#include "../intcode.hpp"
+
+// Converts an Intcode program into a binary image (see image_header in
+// intcode.hpp), which every day and tool can load in place of the text
+// file, without any parsing. By default the image also holds the program's
+// instructions decoded ahead of time, for aoc::program_image::make_vm() to
+// start from; --no-code leaves them out.
+//
+// Usage: ./main input.txt output.img [--no-code]
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fmt::print(stderr, "Usage: {} input.txt output.img [--no-code]\n", argv[0]);
+        return 1;
+    }
+
+    bool with_code = true;
+    for (int i = 3; i < argc; i++) {
+        if (std::string_view(argv[i]) == "--no-code") {
+            with_code = false;
+        } else {
+            fmt::print(stderr, "Unknown option {}\n", argv[i]);
+            return 1;
+        }
+    }
+
+    const auto prog = aoc::load_program(argv[1]);
+    aoc::write_image(argv[2], prog, with_code);
+
+    const aoc::program_image image(argv[2]);
+    fmt::print("Wrote {} words{} to {}\n", image.header().length,
+               with_code ? " and decoded instructions" : "", argv[2]);
+}
@@ -0,0 +1,1878 @@
+#ifndef ADVENT_OF_CODE_2019_INTCODE_HPP
+#define ADVENT_OF_CODE_2019_INTCODE_HPP
+
+#include "../common.hpp"
+
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define AOC_INTCODE_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define AOC_INTCODE_HAVE_MMAP 0
+#endif
+
+namespace aoc {
+
+// Kept out of line so that the error paths don't get in the way of inlining
+// the hot parts of the interpreter
+template <typename... Args>
+[[noreturn, gnu::noinline, gnu::cold]]
+void throw_error(const char* format, const Args&... args)
+{
+    throw std::runtime_error(fmt::format(format, args...));
+}
+
+enum class opcode : uint8_t {
+    add = 1,
+    mul = 2,
+    in = 3,
+    out = 4,
+    jnz = 5,
+    jz = 6,
+    lt = 7,
+    eq = 8,
+    rbo = 9,
+    halt = 99
+};
+
+enum class param_mode : uint8_t {
+    position = 0,
+    immediate = 1,
+    relative = 2
+};
+
+constexpr int num_params(opcode op)
+{
+    switch (op) {
+    case opcode::add: case opcode::mul: case opcode::lt: case opcode::eq:
+        return 3;
+    case opcode::jnz: case opcode::jz:
+        return 2;
+    case opcode::in: case opcode::out: case opcode::rbo:
+        return 1;
+    case opcode::halt:
+        return 0;
+    }
+    return 0;
+}
+
+constexpr bool is_valid_opcode(int64_t op)
+{
+    return (op >= 1 && op <= 9) || op == 99;
+}
+
+struct instruction {
+    opcode op;
+    std::array<param_mode, 3> modes;
+};
+
+// Modes of parameters which the opcode doesn't use are reported as
+// position mode, whatever the instruction word says
+constexpr instruction decode_instruction(int64_t in)
+{
+    if (!is_valid_opcode(in % 100)) {
+        throw_error("Error, got unknown opcode {}\n", in % 100);
+    }
+
+    instruction insn{static_cast<opcode>(in % 100), {}};
+    in /= 100;
+
+    for (int i = 0; i < num_params(insn.op); i++) {
+        if (in % 10 > 2) {
+            throw_error("Unknown mode kind {}\n", in % 10);
+        }
+        insn.modes[i] = static_cast<param_mode>(in % 10);
+        in /= 10;
+    }
+    return insn;
+}
+
+// Whether decode_instruction() would accept `word`
+constexpr bool is_valid_instruction(int64_t word)
+{
+    if (!is_valid_opcode(word % 100)) {
+        return false;
+    }
+
+    const int nparams = num_params(static_cast<opcode>(word % 100));
+    word /= 100;
+    for (int i = 0; i < nparams; i++, word /= 10) {
+        if (word % 10 > 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The interpreter has a separate handler for each opcode and combination of
+// parameter modes it can use. X(op, m0, m1, m2) is expanded for each one.
+#define AOC_INTCODE_MODES_1(X, op) \
+    X(op, 0, 0, 0) X(op, 1, 0, 0) X(op, 2, 0, 0)
+#define AOC_INTCODE_MODES_2_(X, op, m1) \
+    X(op, 0, m1, 0) X(op, 1, m1, 0) X(op, 2, m1, 0)
+#define AOC_INTCODE_MODES_2(X, op) \
+    AOC_INTCODE_MODES_2_(X, op, 0) AOC_INTCODE_MODES_2_(X, op, 1) AOC_INTCODE_MODES_2_(X, op, 2)
+#define AOC_INTCODE_MODES_3_(X, op, m2) \
+    X(op, 0, 0, m2) X(op, 1, 0, m2) X(op, 2, 0, m2) \
+    X(op, 0, 1, m2) X(op, 1, 1, m2) X(op, 2, 1, m2) \
+    X(op, 0, 2, m2) X(op, 1, 2, m2) X(op, 2, 2, m2)
+#define AOC_INTCODE_MODES_3(X, op) \
+    AOC_INTCODE_MODES_3_(X, op, 0) AOC_INTCODE_MODES_3_(X, op, 1) AOC_INTCODE_MODES_3_(X, op, 2)
+
+#define AOC_INTCODE_HANDLERS(X) \
+    AOC_INTCODE_MODES_3(X, add) \
+    AOC_INTCODE_MODES_3(X, mul) \
+    AOC_INTCODE_MODES_1(X, in) \
+    AOC_INTCODE_MODES_1(X, out) \
+    AOC_INTCODE_MODES_2(X, jnz) \
+    AOC_INTCODE_MODES_2(X, jz) \
+    AOC_INTCODE_MODES_3(X, lt) \
+    AOC_INTCODE_MODES_3(X, eq) \
+    AOC_INTCODE_MODES_1(X, rbo) \
+    X(halt, 0, 0, 0)
+
+#define AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2) op##_##m0##m1##m2
+
+// Superinstructions: pairs of instructions which programs produced by the
+// Intcode compiler use a lot, and which get a handler of their own which
+// runs both. F(op, m0, m1, m2, next_op, n0, n1, n2) is expanded for each.
+// The first instruction of each pair never jumps or does I/O, so control
+// always passes to the second.
+
+// Compare, then jump on the result
+#define AOC_INTCODE_FUSED_CMP_(F, cmp, m0, m1) \
+    F(cmp, m0, m1, 0, jnz, 0, 1, 0) F(cmp, m0, m1, 0, jz, 0, 1, 0) \
+    F(cmp, m0, m1, 2, jnz, 2, 1, 0) F(cmp, m0, m1, 2, jz, 2, 1, 0)
+#define AOC_INTCODE_FUSED_CMP(F, cmp) \
+    AOC_INTCODE_FUSED_CMP_(F, cmp, 0, 0) AOC_INTCODE_FUSED_CMP_(F, cmp, 1, 0) \
+    AOC_INTCODE_FUSED_CMP_(F, cmp, 2, 0) AOC_INTCODE_FUSED_CMP_(F, cmp, 0, 1) \
+    AOC_INTCODE_FUSED_CMP_(F, cmp, 1, 1) AOC_INTCODE_FUSED_CMP_(F, cmp, 2, 1) \
+    AOC_INTCODE_FUSED_CMP_(F, cmp, 0, 2) AOC_INTCODE_FUSED_CMP_(F, cmp, 1, 2) \
+    AOC_INTCODE_FUSED_CMP_(F, cmp, 2, 2)
+// Adjust the relative base, then jump (function calls and returns)
+#define AOC_INTCODE_FUSED_RBO_JUMP(F, jump, m0) \
+    F(rbo, 1, 0, 0, jump, m0, 0, 0) F(rbo, 1, 0, 0, jump, m0, 1, 0) \
+    F(rbo, 1, 0, 0, jump, m0, 2, 0)
+// Adjust the relative base, then load from the stack
+#define AOC_INTCODE_FUSED_RBO_LOAD(F, op, m2) \
+    F(rbo, 1, 0, 0, op, 2, 0, m2) F(rbo, 1, 0, 0, op, 2, 1, m2) \
+    F(rbo, 1, 0, 0, op, 2, 2, m2)
+// Add a constant to a loop counter, then jump on it
+#define AOC_INTCODE_FUSED_COUNTER(F, m) \
+    F(add, m, 1, m, jnz, m, 1, 0) F(add, m, 1, m, jz, m, 1, 0) \
+    F(add, 1, m, m, jnz, m, 1, 0) F(add, 1, m, m, jz, m, 1, 0)
+
+#define AOC_INTCODE_FUSED_HANDLERS(F) \
+    AOC_INTCODE_FUSED_CMP(F, lt) \
+    AOC_INTCODE_FUSED_CMP(F, eq) \
+    AOC_INTCODE_FUSED_RBO_JUMP(F, jnz, 0) AOC_INTCODE_FUSED_RBO_JUMP(F, jnz, 1) \
+    AOC_INTCODE_FUSED_RBO_JUMP(F, jnz, 2) AOC_INTCODE_FUSED_RBO_JUMP(F, jz, 0) \
+    AOC_INTCODE_FUSED_RBO_JUMP(F, jz, 1) AOC_INTCODE_FUSED_RBO_JUMP(F, jz, 2) \
+    AOC_INTCODE_FUSED_RBO_LOAD(F, add, 0) AOC_INTCODE_FUSED_RBO_LOAD(F, add, 2) \
+    AOC_INTCODE_FUSED_RBO_LOAD(F, mul, 0) AOC_INTCODE_FUSED_RBO_LOAD(F, mul, 2) \
+    AOC_INTCODE_FUSED_COUNTER(F, 0) \
+    AOC_INTCODE_FUSED_COUNTER(F, 2)
+
+#define AOC_INTCODE_FUSED_NAME(op, m0, m1, m2, next_op, n0, n1, n2) \
+    op##_##m0##m1##m2##_##next_op##_##n0##n1##n2
+
+enum class handler_id : uint8_t {
+    undecoded,
+#define X(op, m0, m1, m2) AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2),
+    AOC_INTCODE_HANDLERS(X)
+#undef X
+#define F(...) AOC_INTCODE_FUSED_NAME(__VA_ARGS__),
+    AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+};
+
+constexpr bool is_fused(handler_id handler)
+{
+    return handler > handler_id::halt_000;
+}
+
+// Whether `handler` is the first half of any superinstruction
+constexpr bool starts_fused(handler_id handler)
+{
+#define F(op, m0, m1, m2, ...) \
+    if (handler == handler_id::AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2)) { \
+        return true; \
+    }
+    AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+    return false;
+}
+
+inline constexpr std::size_t num_handler_ids = 1
+#define X(...) + 1
+    AOC_INTCODE_HANDLERS(X) AOC_INTCODE_FUSED_HANDLERS(X)
+#undef X
+    ;
+
+// Identifies the list of handlers, so that instructions decoded by one build
+// aren't used by another which numbers its handlers differently
+constexpr uint32_t handler_fingerprint()
+{
+    constexpr const char* names[] = {
+#define X(op, m0, m1, m2) #op "_" #m0 #m1 #m2,
+#define F(op, m0, m1, m2, next_op, n0, n1, n2) #op "_" #m0 #m1 #m2 "_" #next_op "_" #n0 #n1 #n2,
+        AOC_INTCODE_HANDLERS(X) AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+#undef X
+    };
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char* name : names) {
+        for (; *name; ++name) {
+            hash = (hash ^ static_cast<uint8_t>(*name)) * 16777619u;
+        }
+        hash = (hash ^ ',') * 16777619u;
+    }
+    return hash;
+}
+
+// The opcode of a handler, or of the first instruction of a superinstruction
+constexpr opcode handler_op(handler_id handler)
+{
+    switch (handler) {
+#define X(op, m0, m1, m2) \
+    case handler_id::AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2): return opcode::op;
+    AOC_INTCODE_HANDLERS(X)
+#undef X
+#define F(op, ...) \
+    case handler_id::AOC_INTCODE_FUSED_NAME(op, __VA_ARGS__): return opcode::op;
+    AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+    case handler_id::undecoded: break;
+    }
+    return opcode::halt;
+}
+
+// The superinstruction which runs `first` and then `second`, or undecoded if
+// there isn't one
+constexpr handler_id fused_handler(handler_id first, handler_id second)
+{
+#define F(op, m0, m1, m2, next_op, n0, n1, n2) \
+    if (first == handler_id::AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2) && \
+        second == handler_id::AOC_INTCODE_HANDLER_NAME(next_op, n0, n1, n2)) { \
+        return handler_id::AOC_INTCODE_FUSED_NAME(op, m0, m1, m2, next_op, n0, n1, n2); \
+    }
+    AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+    return handler_id::undecoded;
+}
+
+// Relies on the handlers for each opcode being listed with the first mode
+// varying fastest
+constexpr handler_id handler_for(const instruction& insn)
+{
+    const auto first = [op = insn.op] {
+        switch (op) {
+        case opcode::add: return handler_id::add_000;
+        case opcode::mul: return handler_id::mul_000;
+        case opcode::in: return handler_id::in_000;
+        case opcode::out: return handler_id::out_000;
+        case opcode::jnz: return handler_id::jnz_000;
+        case opcode::jz: return handler_id::jz_000;
+        case opcode::lt: return handler_id::lt_000;
+        case opcode::eq: return handler_id::eq_000;
+        case opcode::rbo: return handler_id::rbo_000;
+        case opcode::halt: return handler_id::halt_000;
+        }
+        return handler_id::undecoded;
+    }();
+
+    const auto& m = insn.modes;
+    return static_cast<handler_id>(static_cast<int>(first) + static_cast<int>(m[0]) +
+                                   3 * static_cast<int>(m[1]) + 9 * static_cast<int>(m[2]));
+}
+
+// An instruction which has been decoded ahead of time. Position and relative
+// mode operands hold the address or offset, and immediate mode operands hold
+// the value itself.
+struct decoded_instruction {
+    handler_id handler = handler_id::undecoded;
+    // Set if some decoded instruction was read from this address
+    bool covered = false;
+    std::array<int64_t, 3> operands{};
+};
+
+// Does the work of predecode(), with scratch space supplied by the caller
+// (as the same size as the image) so that it can be done at compile time
+template <typename Image, typename Code, typename Flags, typename Addrs>
+constexpr void predecode_into(const Image& image, Code& code, Flags& queued, Flags& second,
+                              Addrs& work)
+{
+    const auto size = static_cast<int64_t>(image.size());
+    std::size_t num_work = 0;
+
+    auto enqueue = [&](int64_t addr) {
+        if (addr >= 0 && addr < size && !queued[addr]) {
+            queued[addr] = true;
+            work[num_work++] = addr;
+        }
+    };
+
+    enqueue(0);
+
+    while (num_work > 0) {
+        for (auto addr = work[--num_work];
+             addr < size && code[addr].handler == handler_id::undecoded &&
+             is_valid_instruction(image[addr]);) {
+            const auto insn = decode_instruction(image[addr]);
+            const int nparams = num_params(insn.op);
+            if (addr + nparams >= size) {
+                break;
+            }
+
+            code[addr].handler = handler_for(insn);
+            for (int i = 0; i < nparams; i++) {
+                code[addr].operands[i] = image[addr + i + 1];
+                if (insn.modes[i] == param_mode::immediate) {
+                    enqueue(image[addr + i + 1]);
+                }
+            }
+            for (int i = 0; i <= nparams; i++) {
+                code[addr + i].covered = true;
+            }
+
+            const bool is_jump = insn.op == opcode::jnz || insn.op == opcode::jz;
+            if (is_jump && insn.modes[1] == param_mode::position) {
+                const auto ptr = code[addr].operands[1];
+                if (ptr >= 0 && ptr < size) {
+                    enqueue(image[ptr]);
+                }
+            }
+
+            const bool always_jumps = is_jump && insn.modes[0] == param_mode::immediate &&
+                (insn.op == opcode::jnz) == (code[addr].operands[0] != 0);
+            if (insn.op == opcode::halt || always_jumps) {
+                break;
+            }
+            addr += nparams + 1;
+        }
+    }
+
+    // Fuse pairs of instructions into superinstructions. The second of each
+    // pair is left alone, so that it is still there for the first to run.
+    for (int64_t addr = 0; addr < size; addr++) {
+        if (code[addr].handler == handler_id::undecoded || second[addr]) {
+            continue;
+        }
+        const auto next = addr + num_params(decode_instruction(image[addr]).op) + 1;
+        if (next < size) {
+            const auto fused = fused_handler(code[addr].handler, code[next].handler);
+            if (fused != handler_id::undecoded) {
+                code[addr].handler = fused;
+                second[next] = true;
+            }
+        }
+    }
+}
+
+// Decodes the instructions of `image` which can be reached from the start of
+// the program: by falling through, by constant jumps, or through any other
+// constant the program uses, in case it's a return address. Anything else is
+// left to be decoded when it's first run, as usual.
+template <typename T, std::size_t N>
+constexpr std::array<decoded_instruction, N> predecode(const std::array<T, N>& image)
+{
+    std::array<decoded_instruction, N> code{};
+    std::array<bool, N> queued{};
+    std::array<bool, N> second{};
+    std::array<int64_t, N> work{};
+    predecode_into(image, code, queued, second, work);
+    return code;
+}
+
+inline std::vector<decoded_instruction> predecode(const std::vector<int64_t>& image)
+{
+    std::vector<decoded_instruction> code(image.size());
+    std::vector<bool> queued(image.size());
+    std::vector<bool> second(image.size());
+    std::vector<int64_t> work(image.size());
+    predecode_into(image, code, queued, second, work);
+    return code;
+}
+
+// A program which is known at compile time, with its instructions decoded at
+// compile time too. A VM made from one never needs to decode an instruction
+// unless the program modifies itself, e.g.
+//
+//     static constexpr auto prog = std::array{...};
+//     auto vm = aoc::intcode{aoc::static_program<prog>{}};
+template <const auto& Image>
+struct static_program {
+    static constexpr auto code = predecode(Image);
+};
+
+// Flat, bounds-checked memory of a fixed size. This is all we can use if we
+// want to run a VM at compile time, so instructions are decoded each time
+// they are executed rather than cached.
+template <std::size_t N>
+struct fixed_memory {
+    static constexpr bool cache_code = false;
+
+    template <typename Program>
+    constexpr explicit fixed_memory(const Program& prog)
+    {
+        if (nano::distance(prog) > static_cast<std::ptrdiff_t>(N)) {
+            throw_error("Program too large for {} words of memory\n", N);
+        }
+        nano::copy(prog, words_.begin());
+    }
+
+    constexpr int64_t load(int64_t addr) const { return words_[check(addr)]; }
+
+    constexpr void store(int64_t addr, int64_t val) { words_[check(addr)] = val; }
+
+private:
+    static constexpr std::size_t check(int64_t addr)
+    {
+        if (addr < 0 || addr >= static_cast<int64_t>(N)) {
+            throw_error("Address {} out of range\n", addr);
+        }
+        return static_cast<std::size_t>(addr);
+    }
+
+    std::array<int64_t, N> words_{};
+};
+
+// Whether `ptr` is the only owner of its object, so that it may be changed
+// in place. A copy on another thread may have just let go of it: the fence
+// pairs with the release in that copy's destructor, so that whatever the
+// other thread did with the object happens before we change it.
+template <typename T>
+bool sole_owner(const std::shared_ptr<T>& ptr)
+{
+    if (ptr.use_count() != 1) {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+// Memory split into pages. The pages holding the program image are
+// allocated up front, and the rest only when they are first written; loads
+// from addresses which have never been written return zero.
+//
+// Pages are shared between copies, and only copied when one side writes to
+// them, so copying memory costs as much as the number of pages in use rather
+// than their contents. Together with the VM sharing its decoded instructions
+// in the same way, this makes it practical to snapshot a VM and fork it, for
+// example to search through the states of a program. Copies can be used from
+// different threads, although a single VM cannot.
+struct paged_memory {
+    static constexpr bool cache_code = true;
+
+    static constexpr int page_bits = 9;
+    static constexpr int64_t page_size = int64_t{1} << page_bits;
+    // Pages below this number are found via a table, and above it via a hash
+    // map. This keeps the (common) case of a stack just past the end of the
+    // program image fast, without needing a huge table for far addresses.
+    static constexpr int64_t max_near_pages = 1 << 15;
+
+    using page = std::array<int64_t, page_size>;
+    using page_ptr = std::shared_ptr<page>;
+
+    template <typename Program>
+    explicit paged_memory(const Program& prog)
+    {
+        const auto size = static_cast<int64_t>(nano::distance(prog));
+        near_pages_.resize((size + page_size - 1) >> page_bits);
+        for (auto& ptr : near_pages_) {
+            ptr = std::make_shared<page>();
+        }
+
+        int64_t addr = 0;
+        for (const auto& word : prog) {
+            (*near_pages_[addr >> page_bits])[addr & (page_size - 1)] = word;
+            ++addr;
+        }
+    }
+
+    // Memory with no pages yet, to be filled in by set_page()
+    paged_memory() = default;
+
+    int64_t load(int64_t addr) const
+    {
+        // Negative addresses end up as huge page numbers, and so get
+        // rejected on the slow path
+        const auto n = static_cast<uint64_t>(addr) >> page_bits;
+        if (n < near_pages_.size()) {
+            const page* p = near_pages_[n].get();
+            return p ? (*p)[addr & (page_size - 1)] : 0;
+        }
+        return load_far(addr);
+    }
+
+    void store(int64_t addr, int64_t val)
+    {
+        const auto n = static_cast<uint64_t>(addr) >> page_bits;
+        if (n < near_pages_.size() && sole_owner(near_pages_[n])) {
+            (*near_pages_[n])[addr & (page_size - 1)] = val;
+        } else {
+            store_slow(addr, val);
+        }
+    }
+
+    // Calls f(n, page) for every page which exists: those holding the
+    // program image, and those written to since
+    template <typename F>
+    void for_each_page(F f) const
+    {
+        for (std::size_t n = 0; n < near_pages_.size(); n++) {
+            if (near_pages_[n]) {
+                f(static_cast<int64_t>(n), *near_pages_[n]);
+            }
+        }
+        for (const auto& [n, ptr] : far_pages_) {
+            f(n, *ptr);
+        }
+    }
+
+    void set_page(int64_t n, page_ptr ptr)
+    {
+        if (n < 0 || n > (std::numeric_limits<int64_t>::max() >> page_bits)) {
+            throw_error("Page {} out of range\n", n);
+        }
+        (n < max_near_pages ? near_page_slot(n) : far_pages_[n]) = std::move(ptr);
+    }
+
+private:
+    [[gnu::noinline]] int64_t load_far(int64_t addr) const
+    {
+        check(addr);
+        const auto it = far_pages_.find(addr >> page_bits);
+        return it != far_pages_.end() ? (*it->second)[addr & (page_size - 1)] : 0;
+    }
+
+    // Allocates the page for `addr` if it doesn't exist yet, or makes our own
+    // copy of it if it is shared
+    [[gnu::noinline]] void store_slow(int64_t addr, int64_t val)
+    {
+        check(addr);
+        const int64_t n = addr >> page_bits;
+        auto& ptr = n < max_near_pages ? near_page_slot(n) : far_pages_[n];
+        if (!ptr) {
+            ptr = std::make_shared<page>();
+        } else if (!sole_owner(ptr)) {
+            ptr = std::make_shared<page>(*ptr);
+        }
+        (*ptr)[addr & (page_size - 1)] = val;
+    }
+
+    page_ptr& near_page_slot(int64_t n)
+    {
+        if (n >= static_cast<int64_t>(near_pages_.size())) {
+            near_pages_.resize(n + 1);
+        }
+        return near_pages_[n];
+    }
+
+    static void check(int64_t addr)
+    {
+        if (addr < 0) {
+            throw_error("Address {} out of range\n", addr);
+        }
+    }
+
+    std::vector<page_ptr> near_pages_;
+    std::unordered_map<int64_t, page_ptr> far_pages_;
+};
+
+using default_memory = paged_memory;
+
+// How the interpreter gets from one instruction to the next: either a loop
+// around a switch on the handler, or (with GCC and Clang) "threaded" code
+// where each handler jumps straight to the next one via a computed goto.
+// The threaded interpreter cannot run at compile time, so VMs which do not
+// cache decoded instructions always use the switch.
+enum class dispatch {
+    switched,
+    threaded
+};
+
+#if defined(AOC_INTCODE_SWITCH_DISPATCH) || !defined(__GNUC__)
+inline constexpr dispatch default_dispatch = dispatch::switched;
+#else
+inline constexpr dispatch default_dispatch = dispatch::threaded;
+#endif
+
+#ifdef AOC_INTCODE_PROFILE
+inline constexpr bool default_profiling = true;
+#else
+inline constexpr bool default_profiling = false;
+#endif
+
+constexpr const char* opcode_name(opcode op)
+{
+    switch (op) {
+    case opcode::add: return "add";
+    case opcode::mul: return "mul";
+    case opcode::in: return "in";
+    case opcode::out: return "out";
+    case opcode::jnz: return "jnz";
+    case opcode::jz: return "jz";
+    case opcode::lt: return "lt";
+    case opcode::eq: return "eq";
+    case opcode::rbo: return "rbo";
+    case opcode::halt: return "halt";
+    }
+    return "?";
+}
+
+// Counts of what a VM has been doing, kept when profiling is turned on (by
+// defining AOC_INTCODE_PROFILE, or with intcode's Profile parameter). With
+// it turned off, none of this is compiled into the interpreter at all.
+struct intcode_profile {
+    struct address_counts {
+        uint64_t executed = 0;
+        uint64_t taken = 0;
+        bool jump = false;
+    };
+
+    static constexpr std::size_t num_handlers = static_cast<std::size_t>(handler_id::halt_000) + 1;
+
+    std::vector<address_counts> by_address;
+    std::array<uint64_t, num_handlers> by_handler{};
+    uint64_t inputs = 0;
+    uint64_t input_waits = 0; // times the VM stopped for want of an input
+    uint64_t outputs = 0;
+
+    void executed(int64_t addr, handler_id handler)
+    {
+        if (static_cast<uint64_t>(addr) >= by_address.size()) {
+            by_address.resize(addr + 1);
+        }
+        ++by_address[addr].executed;
+        ++by_handler[static_cast<std::size_t>(handler)];
+    }
+
+    void branch(int64_t addr, bool taken)
+    {
+        by_address[addr].jump = true;
+        by_address[addr].taken += taken;
+    }
+
+    uint64_t total() const { return aoc::accumulate(by_handler, uint64_t{0}); }
+
+    void print(std::FILE* out = stderr, std::size_t max_rows = 20) const
+    {
+        static constexpr const char* handler_names[] = { "undecoded",
+#define X(op, m0, m1, m2) #op "_" #m0 #m1 #m2,
+            AOC_INTCODE_HANDLERS(X)
+#undef X
+        };
+        static constexpr opcode handler_ops[] = { opcode::halt,
+#define X(op, m0, m1, m2) opcode::op,
+            AOC_INTCODE_HANDLERS(X)
+#undef X
+        };
+
+        const auto total = this->total();
+        auto percent = [&](uint64_t n) { return total ? 100.0 * n / total : 0.0; };
+
+        fmt::print(out, "{} instructions executed\n", total);
+        fmt::print(out, "{} inputs ({} waits), {} outputs\n", inputs, input_waits, outputs);
+
+        std::array<uint64_t, 100> by_op{};
+        for (std::size_t h = 1; h < num_handlers; h++) {
+            by_op[static_cast<std::size_t>(handler_ops[h])] += by_handler[h];
+        }
+        fmt::print(out, "\nBy opcode:\n");
+        for (std::size_t op = 0; op < by_op.size(); op++) {
+            if (by_op[op] > 0) {
+                fmt::print(out, "  {:<5} {:>12} {:6.2f}%\n", opcode_name(static_cast<opcode>(op)),
+                           by_op[op], percent(by_op[op]));
+            }
+        }
+
+        std::vector<std::size_t> rows;
+        for (std::size_t h = 1; h < num_handlers; h++) {
+            if (by_handler[h] > 0) {
+                rows.push_back(h);
+            }
+        }
+        nano::sort(rows, nano::greater{}, [&](std::size_t h) { return by_handler[h]; });
+        rows.resize(nano::min(rows.size(), max_rows));
+        fmt::print(out, "\nHottest handlers:\n");
+        for (auto h : rows) {
+            fmt::print(out, "  {:<8} {:>12} {:6.2f}%\n", handler_names[h], by_handler[h],
+                       percent(by_handler[h]));
+        }
+
+        rows.clear();
+        for (std::size_t addr = 0; addr < by_address.size(); addr++) {
+            if (by_address[addr].executed > 0) {
+                rows.push_back(addr);
+            }
+        }
+        nano::sort(rows, nano::greater{}, [&](std::size_t a) { return by_address[a].executed; });
+        rows.resize(nano::min(rows.size(), max_rows));
+        fmt::print(out, "\nHottest addresses:\n");
+        for (auto addr : rows) {
+            const auto& c = by_address[addr];
+            fmt::print(out, "  {:>8} {:>12} {:6.2f}%", addr, c.executed, percent(c.executed));
+            if (c.jump) {
+                fmt::print(out, "  (jump taken {:.1f}%)", 100.0 * c.taken / c.executed);
+            }
+            fmt::print(out, "\n");
+        }
+    }
+};
+
+// Why a call to intcode::resume() returned
+enum class event {
+    need_input, // the program is waiting at an input instruction
+    output,     // the program has produced a value, available from output()
+    halted
+};
+
+// VMs which can run at compile time are never profiled, as the counters
+// need memory to be allocated
+template <typename Memory = default_memory, dispatch Dispatch = default_dispatch,
+          bool Profile = default_profiling>
+struct intcode {
+    template <typename Program>
+    constexpr explicit intcode(const Program& prog)
+        : memory_(prog)
+    {
+        if constexpr (Memory::cache_code) {
+            code_ = std::make_shared<code_table>(nano::distance(prog));
+        }
+    }
+
+    // Starts with the instructions of `prog` already decoded, as by
+    // predecode()
+    template <typename Program>
+    intcode(const Program& prog, std::vector<decoded_instruction> code)
+        : intcode(prog, std::make_shared<std::vector<decoded_instruction>>(std::move(code)))
+    {}
+
+    // As above, sharing the decoded instructions with whoever else has them,
+    // until this VM needs to change them
+    template <typename Program>
+    intcode(const Program& prog, std::shared_ptr<std::vector<decoded_instruction>> code)
+        : memory_(prog)
+    {
+        if constexpr (Memory::cache_code) {
+            code_ = std::move(code);
+            const auto size = static_cast<std::size_t>(nano::distance(prog));
+            if (code_->size() != size) {
+                own_code().resize(size);
+            }
+        }
+    }
+
+    template <const auto& Image>
+    constexpr explicit intcode(static_program<Image>)
+        : memory_(Image)
+    {
+        if constexpr (Memory::cache_code) {
+            const auto& code = static_program<Image>::code;
+            code_ = std::make_shared<code_table>(code.begin(), code.end());
+        }
+    }
+
+    // Everything about a running VM apart from its memory (and what it has
+    // decoded, which can be worked out again), as saved by save_checkpoint()
+    struct state {
+        int64_t iptr = 0;
+        int64_t relbase = 0;
+        int64_t pending_input = 0;
+        bool has_pending_input = false;
+        int64_t output = 0;
+        bool done = false;
+        // The length of the original program, which the code cache covers
+        std::size_t image_size = 0;
+    };
+
+    // Carries on from `st`, with instructions decoded as they are reached
+    intcode(Memory memory, const state& st)
+        : memory_(std::move(memory)),
+          iptr_(st.iptr),
+          relbase_(st.relbase),
+          pending_input_(st.pending_input),
+          has_pending_input_(st.has_pending_input),
+          output_(st.output),
+          done_(st.done)
+    {
+        if constexpr (Memory::cache_code) {
+            code_ = std::make_shared<code_table>(st.image_size);
+        }
+    }
+
+    state get_state() const
+    {
+        std::size_t image_size = 0;
+        if constexpr (Memory::cache_code) {
+            image_size = code_->size();
+        }
+        return {iptr_, relbase_, pending_input_, has_pending_input_, output_, done_, image_size};
+    }
+
+    const Memory& memory() const { return memory_; }
+
+    template <typename In, typename Out>
+    constexpr void run(In in_fn, Out out_fn)
+    {
+        callback_io<In, Out> io{in_fn, out_fn};
+        execute(io);
+    }
+
+    // Runs until the program needs an input which has not been supplied with
+    // push_input(), produces an output, or halts. At an input instruction the
+    // VM stays put, so calling resume() again without pushing an input just
+    // returns event::need_input once more.
+    constexpr event resume()
+    {
+        suspending_io io;
+        return execute(io);
+    }
+
+    // Supplies the value for the next input instruction
+    constexpr void push_input(int64_t val)
+    {
+        if (has_pending_input_) {
+            throw_error("Intcode input {} pushed while {} is still pending", val, pending_input_);
+        }
+        pending_input_ = val;
+        has_pending_input_ = true;
+    }
+
+    // The value produced by the most recent event::output
+    constexpr int64_t output() const { return output_; }
+
+    // Runs until the next input instruction (without executing it), returning
+    // any outputs produced along the way
+    std::vector<int64_t> run_until_input()
+    {
+        std::vector<int64_t> outputs;
+        while (resume() == event::output) {
+            outputs.push_back(output_);
+        }
+        return outputs;
+    }
+
+    // Runs until the VM has consumed the given input, discarding any outputs
+    constexpr void feed(int64_t input)
+    {
+        push_input(input);
+        while (has_pending_input_ && resume() != event::halted) {}
+    }
+
+    // Runs until the next output, supplying `input` to any input instructions.
+    // If the VM halts without producing an output, returns `input`.
+    constexpr int64_t run_until_output(int64_t input)
+    {
+        return next_output([input] { return input; }, input);
+    }
+
+    // Runs until the next output, or returns zero if the VM halts first
+    template <typename InFn>
+    constexpr int64_t next_output(InFn in_fn, int64_t if_halted = 0)
+    {
+        while (true) {
+            switch (resume()) {
+            case event::need_input:
+                push_input(in_fn());
+                break;
+            case event::output:
+                return output_;
+            case event::halted:
+                return if_halted;
+            }
+        }
+    }
+
+    constexpr bool done() const { return done_; }
+
+    // What the VM has executed so far, if it's being profiled
+    const auto& profile() const { return profile_; }
+
+    constexpr int64_t peek(int64_t addr) const { return memory_.load(addr); }
+
+    constexpr void poke(int64_t addr, int64_t val) { store(addr, val); }
+
+    // Sets the registers, so that the interpreter can carry on from where some
+    // other executor (such as code generated by intcode/translate) left off
+    constexpr void jump(int64_t iptr, int64_t relbase)
+    {
+        iptr_ = iptr;
+        relbase_ = relbase;
+    }
+
+private:
+    // The interpreter talks to the outside world through an I/O policy.
+    // read() and write() return false to suspend the VM: at the input
+    // instruction, or just after the output instruction respectively.
+    template <typename In, typename Out>
+    struct callback_io {
+        In& in_fn;
+        Out& out_fn;
+
+        constexpr bool read(int64_t& val) { val = in_fn(); return true; }
+        constexpr bool write(int64_t val) { out_fn(val); return true; }
+    };
+
+    struct suspending_io {
+        constexpr bool read(int64_t&) { return false; }
+        constexpr bool write(int64_t) { return false; }
+    };
+
+    // Runs the interpreter until the VM halts or the I/O policy suspends it.
+    // The registers are kept in locals while it runs: otherwise every store to
+    // memory could alias them, forcing a reload.
+    template <typename Io>
+    constexpr event execute(Io& io)
+    {
+        if constexpr (Dispatch == dispatch::threaded && Memory::cache_code) {
+            return execute_threaded(io);
+        } else {
+            return execute_switched(io);
+        }
+    }
+
+    template <typename Io>
+    constexpr event execute_switched(Io& io)
+    {
+        int64_t iptr = iptr_;
+        int64_t relbase = relbase_;
+        event ev = event::halted;
+        bool running = !done_;
+        const decoded_instruction* insn = running ? &enter(iptr) : nullptr;
+
+        while (running) {
+            switch (insn->handler) {
+#define X(op, m0, m1, m2) \
+            case handler_id::AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2): \
+                running = exec<opcode::op, m0, m1, m2>(*insn, iptr, relbase, io); \
+                ev = suspend_event(opcode::op); \
+                insn = running ? next_insn(opcode::op, insn, iptr) : insn; \
+                break;
+            AOC_INTCODE_HANDLERS(X)
+#undef X
+#define F(op, m0, m1, m2, next_op, n0, n1, n2) \
+            case handler_id::AOC_INTCODE_FUSED_NAME(op, m0, m1, m2, next_op, n0, n1, n2): \
+                running = exec_fused<opcode::op, m0, m1, m2, opcode::next_op, n0, n1, n2>( \
+                    insn, iptr, relbase, io); \
+                ev = suspend_event(opcode::next_op); \
+                insn = running ? next_insn(opcode::next_op, insn, iptr) : insn; \
+                break;
+            AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+            case handler_id::undecoded:
+                // The end of a block, or an instruction which has been
+                // invalidated since its block was built
+                insn = &enter(iptr);
+                break;
+            }
+        }
+
+        iptr_ = iptr;
+        relbase_ = relbase;
+        return ev;
+    }
+
+#ifdef __GNUC__
+    template <typename Io>
+    event execute_threaded(Io& io)
+    {
+#define X(op, m0, m1, m2) &&AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2),
+#define F(...) &&AOC_INTCODE_FUSED_NAME(__VA_ARGS__),
+        static void* const labels[] = {
+            &&undecoded, AOC_INTCODE_HANDLERS(X) AOC_INTCODE_FUSED_HANDLERS(F)
+        };
+#undef F
+#undef X
+
+        int64_t iptr = iptr_;
+        int64_t relbase = relbase_;
+        const decoded_instruction* insn = nullptr;
+        event ev = event::halted;
+
+#define AOC_INTCODE_DISPATCH() \
+        goto *labels[static_cast<int>(insn->handler)]
+
+        if (done_) {
+            return ev;
+        }
+        insn = &enter(iptr);
+        AOC_INTCODE_DISPATCH();
+
+#define X(op, m0, m1, m2) \
+    AOC_INTCODE_HANDLER_NAME(op, m0, m1, m2): \
+        if (!exec<opcode::op, m0, m1, m2>(*insn, iptr, relbase, io)) { \
+            ev = suspend_event(opcode::op); \
+            goto finished; \
+        } \
+        insn = next_insn(opcode::op, insn, iptr); \
+        AOC_INTCODE_DISPATCH();
+
+        AOC_INTCODE_HANDLERS(X)
+#undef X
+
+#define F(op, m0, m1, m2, next_op, n0, n1, n2) \
+    AOC_INTCODE_FUSED_NAME(op, m0, m1, m2, next_op, n0, n1, n2): \
+        if (!exec_fused<opcode::op, m0, m1, m2, opcode::next_op, n0, n1, n2>( \
+                insn, iptr, relbase, io)) { \
+            ev = suspend_event(opcode::next_op); \
+            goto finished; \
+        } \
+        insn = next_insn(opcode::next_op, insn, iptr); \
+        AOC_INTCODE_DISPATCH();
+
+        AOC_INTCODE_FUSED_HANDLERS(F)
+#undef F
+
+    undecoded:
+        // The end of a block, or an instruction which has been invalidated
+        // since its block was built
+        insn = &enter(iptr);
+        AOC_INTCODE_DISPATCH();
+#undef AOC_INTCODE_DISPATCH
+
+    finished:
+        iptr_ = iptr;
+        relbase_ = relbase;
+        return ev;
+    }
+#endif
+
+    // Only input, output and halt instructions ever stop the interpreter
+    static constexpr event suspend_event(opcode op)
+    {
+        switch (op) {
+        case opcode::in: return event::need_input;
+        case opcode::out: return event::output;
+        default: return event::halted;
+        }
+    }
+
+    static constexpr bool profiling = Profile && Memory::cache_code;
+
+    // Executes one instruction, returning false if the VM should stop
+    template <opcode Op, int M0, int M1, int M2, typename Io>
+    constexpr bool exec(const decoded_instruction& insn, int64_t& iptr, int64_t& relbase, Io& io)
+    {
+        constexpr std::array modes{param_mode{M0}, param_mode{M1}, param_mode{M2}};
+
+        // The instruction may be part of a superinstruction, so we don't
+        // count it under insn.handler
+        constexpr auto handler = handler_for(instruction{Op, modes});
+
+        // An input instruction which has to wait isn't counted until it runs
+        if constexpr (profiling && Op != opcode::in) {
+            profile_.executed(iptr, handler);
+        }
+
+        auto get = [&] (int argnum) -> int64_t {
+            switch (modes[argnum]) {
+            case param_mode::position:
+                return memory_.load(insn.operands[argnum]);
+            case param_mode::immediate:
+                return insn.operands[argnum];
+            case param_mode::relative:
+                return memory_.load(relbase + insn.operands[argnum]);
+            }
+            return 0;
+        };
+
+        auto set = [&] (int argnum, int64_t val) {
+            switch (modes[argnum]) {
+            case param_mode::position:
+                return store(insn.operands[argnum], val);
+            case param_mode::immediate:
+                return store(iptr + argnum + 1, val);
+            case param_mode::relative:
+                return store(relbase + insn.operands[argnum], val);
+            }
+        };
+
+        if constexpr (Op == opcode::add) {
+            set(2, get(0) + get(1));
+            iptr += 4;
+        } else if constexpr (Op == opcode::mul) {
+            set(2, get(0) * get(1));
+            iptr += 4;
+        } else if constexpr (Op == opcode::in) {
+            int64_t val = 0;
+            if (has_pending_input_) {
+                val = pending_input_;
+                has_pending_input_ = false;
+            } else if (!io.read(val)) {
+                if constexpr (profiling) {
+                    ++profile_.input_waits;
+                }
+                return false;
+            }
+            if constexpr (profiling) {
+                profile_.executed(iptr, handler);
+                ++profile_.inputs;
+            }
+            set(0, val);
+            iptr += 2;
+        } else if constexpr (Op == opcode::out) {
+            if constexpr (profiling) {
+                ++profile_.outputs;
+            }
+            output_ = get(0);
+            iptr += 2;
+            return io.write(output_);
+        } else if constexpr (Op == opcode::jnz || Op == opcode::jz) {
+            const bool taken = (get(0) != 0) == (Op == opcode::jnz);
+            if constexpr (profiling) {
+                profile_.branch(iptr, taken);
+            }
+            iptr = taken ? get(1) : iptr + 3;
+        } else if constexpr (Op == opcode::lt) {
+            set(2, get(0) < get(1) ? 1 : 0);
+            iptr += 4;
+        } else if constexpr (Op == opcode::eq) {
+            set(2, get(0) == get(1) ? 1 : 0);
+            iptr += 4;
+        } else if constexpr (Op == opcode::rbo) {
+            relbase += get(0);
+            iptr += 2;
+        } else if constexpr (Op == opcode::halt) {
+            done_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Runs the first instruction of a superinstruction, then the second
+    // (which follows it in the block), leaving `insn` pointing at the last
+    // one run. The second is skipped if its cached copy has been thrown away
+    // in the meantime, by the first instruction writing to it say.
+    template <opcode Op, int M0, int M1, int M2,
+              opcode NextOp, int N0, int N1, int N2, typename Io>
+    constexpr bool exec_fused(const decoded_instruction*& insn, int64_t& iptr, int64_t& relbase, Io& io)
+    {
+        if constexpr (Memory::cache_code) {
+            constexpr auto second = handler_for(
+                instruction{NextOp, {param_mode{N0}, param_mode{N1}, param_mode{N2}}});
+
+            exec<Op, M0, M1, M2>(*insn, iptr, relbase, io);
+            if (insn[1].handler != second) {
+                return true;
+            }
+            ++insn;
+            return exec<NextOp, N0, N1, N2>(*insn, iptr, relbase, io);
+        } else {
+            return false;
+        }
+    }
+
+    // The instruction to run after `insn`, which ended with `op`. Within a
+    // block that's simply the next one along, and after a jump it's the
+    // start of another block.
+    constexpr const decoded_instruction* next_insn(opcode op, const decoded_instruction* insn,
+                                                   int64_t iptr)
+    {
+        if (Memory::cache_code && op != opcode::jnz && op != opcode::jz) {
+            return insn + 1;
+        }
+        return &enter(iptr);
+    }
+
+    // Returns the first instruction of the block starting at `addr`, building
+    // the block if it is not already cached. VMs which don't cache code just
+    // decode the one instruction.
+    constexpr const decoded_instruction& enter(int64_t addr)
+    {
+        if constexpr (Memory::cache_code) {
+            if (static_cast<uint64_t>(addr) < blocks_.entry.size()) {
+                if (const auto entry = blocks_.entry[addr]; entry != 0) {
+                    return blocks_.code[entry - 1];
+                }
+            }
+            return build_block(addr);
+        } else {
+            decode_at(addr, scratch_[0]);
+            return scratch_[0];
+        }
+    }
+
+    // Copies instructions from the code cache (decoding them as necessary)
+    // into a new block, up to the first jump or halt
+    [[gnu::noinline]] const decoded_instruction& build_block(int64_t addr)
+    {
+        const auto size = static_cast<int64_t>(code_->size());
+        if (addr < 0 || addr >= size) {
+            // Outside the program image we go one instruction at a time
+            decode_at(addr, scratch_[0]);
+            return scratch_[0];
+        }
+
+        auto& cache = blocks_;
+        // Blocks which are thrown away can't be freed, as one of them might
+        // be running, so once there's enough garbage we start again
+        if (cache.code.size() > 4 * code_->size() + 1024) {
+            cache.code.clear();
+            cache.blocks.clear();
+            nano::fill(cache.entry, 0);
+        }
+        cache.entry.resize(code_->size());
+
+        const auto offset = cache.code.size();
+        int64_t end = addr;
+        while (true) {
+            // Decoding may give us our own copy of the code cache, so this
+            // isn't kept in a reference
+            if ((*code_)[end].handler == handler_id::undecoded) {
+                if (!fits_in_image(end)) {
+                    if (end == addr) {
+                        decode_at(addr, scratch_[0]);
+                        return scratch_[0];
+                    }
+                    break;
+                }
+                decode_cached(end);
+            }
+            cache.code.push_back((*code_)[end]);
+
+            const auto op = handler_op((*code_)[end].handler);
+            end += num_params(op) + 1;
+            if (op == opcode::jnz || op == opcode::jz || op == opcode::halt || end >= size) {
+                break;
+            }
+            // Leave anything which doesn't decode to be reported if it's run
+            if ((*code_)[end].handler == handler_id::undecoded &&
+                !is_valid_instruction(memory_.load(end))) {
+                break;
+            }
+        }
+        // Every block ends with an undecoded instruction, which takes us to
+        // the next one
+        cache.code.emplace_back();
+
+        cache.blocks.push_back({addr, end, offset, cache.code.size() - offset});
+        cache.entry[addr] = offset + 1;
+        return cache.code[offset];
+    }
+
+    // Returns the length of the instruction
+    constexpr int decode_at(int64_t addr, decoded_instruction& out)
+    {
+        const auto insn = decode_instruction(memory_.load(addr));
+        const int nparams = num_params(insn.op);
+
+        out.handler = handler_for(insn);
+        for (int i = 0; i < nparams; i++) {
+            out.operands[i] = memory_.load(addr + i + 1);
+        }
+
+        return nparams + 1;
+    }
+
+    // Whether all of the (valid) instruction at `addr` lies within the
+    // program image. Stores past the end of the image don't invalidate
+    // anything, so instructions which run off the end are never cached.
+    bool fits_in_image(int64_t addr) const
+    {
+        const auto op = decode_instruction(memory_.load(addr)).op;
+        return addr + num_params(op) < static_cast<int64_t>(code_->size());
+    }
+
+    void decode_cached(int64_t addr)
+    {
+        fuse(addr, addr + cache_insn(addr));
+    }
+
+    // Decodes the instruction at `addr`, which must fit in the image, into
+    // the code cache, noting the words it was decoded from. Returns its
+    // length.
+    int cache_insn(int64_t addr)
+    {
+        auto& code = own_code();
+        const int len = decode_at(addr, code[addr]);
+        for (int i = 0; i < len; i++) {
+            code[addr + i].covered = true;
+        }
+        return len;
+    }
+
+    // Turns the newly-decoded instruction at `addr` into a superinstruction,
+    // if it forms one with the instruction at `next`. That is always run
+    // straight after the first, so can be decoded now; it is left as it is
+    // rather than being fused with whatever follows it in turn.
+    void fuse(int64_t addr, int64_t next)
+    {
+        auto& code = own_code();
+        if (!starts_fused(code[addr].handler) || static_cast<uint64_t>(next) >= code.size()) {
+            return;
+        }
+        if (code[next].handler == handler_id::undecoded) {
+            if (!is_valid_instruction(memory_.load(next)) || !fits_in_image(next)) {
+                return;
+            }
+            cache_insn(next);
+        }
+        const auto fused = fused_handler(code[addr].handler, code[next].handler);
+        if (fused != handler_id::undecoded) {
+            code[addr].handler = fused;
+        }
+    }
+
+    // Every store goes through here, so that cached instructions which were
+    // decoded from the address being written can be thrown away
+    constexpr void store(int64_t addr, int64_t val)
+    {
+        memory_.store(addr, val);
+
+        if constexpr (Memory::cache_code) {
+            if (static_cast<uint64_t>(addr) < code_->size() && (*code_)[addr].covered) {
+                invalidate(addr);
+            }
+        }
+    }
+
+    [[gnu::noinline]] void invalidate(int64_t addr)
+    {
+        // An instruction is at most four words long
+        auto& code = own_code();
+        for (int64_t i = nano::max(addr - 3, int64_t{0}); i <= addr; i++) {
+            code[i].handler = handler_id::undecoded;
+        }
+
+        // Blocks holding the address are unlinked, and their instructions
+        // marked as undecoded so that a block which modifies itself stops
+        // at the next instruction
+        auto& blocks = blocks_.blocks;
+        for (std::size_t i = 0; i < blocks.size();) {
+            const auto& b = blocks[i];
+            if (b.start <= addr && addr < b.end) {
+                for (std::size_t j = 0; j < b.size; j++) {
+                    blocks_.code[b.offset + j].handler = handler_id::undecoded;
+                }
+                blocks_.entry[b.start] = 0;
+                blocks[i] = blocks.back();
+                blocks.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // Straight-line runs of instructions from the code cache, copied one
+    // after another so that the interpreter can step through them without
+    // having to look each one up
+    struct block_cache {
+        struct block {
+            int64_t start;
+            int64_t end;
+            std::size_t offset;
+            std::size_t size;
+        };
+
+        block_cache() = default;
+        block_cache(block_cache&&) = default;
+        block_cache& operator=(block_cache&&) = default;
+
+        // Blocks are quick to build again from the code cache, so copies of
+        // a VM start without any rather than copying them
+        block_cache(const block_cache&) {}
+
+        block_cache& operator=(const block_cache&)
+        {
+            code.clear();
+            blocks.clear();
+            entry.clear();
+            return *this;
+        }
+
+        std::vector<decoded_instruction> code;
+        std::vector<block> blocks;
+        // One more than the offset of the block starting at each address, or
+        // zero if there isn't one
+        std::vector<std::size_t> entry;
+    };
+
+    using code_table = std::vector<decoded_instruction>;
+
+    // The code cache is shared between copies of the VM, like the pages of
+    // paged_memory, until one of them needs to change it. The interpreter
+    // only ever holds pointers into the block cache, so this can happen at
+    // any time.
+    code_table& own_code()
+    {
+        if (!sole_owner(code_)) {
+            code_ = std::make_shared<code_table>(*code_);
+        }
+        return *code_;
+    }
+
+    struct no_code_cache {};
+    struct no_profile {};
+
+    Memory memory_;
+    std::conditional_t<Memory::cache_code, std::shared_ptr<code_table>, no_code_cache> code_{};
+    std::conditional_t<Memory::cache_code, block_cache, no_code_cache> blocks_{};
+    // An instruction decoded outside the code cache, followed by an undecoded
+    // one to end the "block"
+    std::array<decoded_instruction, 2> scratch_{};
+    std::conditional_t<profiling, intcode_profile, no_profile> profile_{};
+    int64_t iptr_ = 0;
+    int64_t relbase_ = 0;
+    int64_t pending_input_ = 0;
+    bool has_pending_input_ = false;
+    int64_t output_ = 0;
+    bool done_ = false;
+};
+
+// Programs known at compile time get exactly as much memory as they need,
+// so that they can be run in constant expressions
+template <typename T, std::size_t N>
+intcode(const std::array<T, N>&) -> intcode<fixed_memory<N>>;
+
+template <const auto& Image>
+intcode(static_program<Image>) -> intcode<default_memory>;
+
+template <typename Program>
+intcode(const Program&) -> intcode<default_memory>;
+
+// The contents of a file, mapped into memory where we can (so that reading
+// it doesn't copy it), or read into a buffer otherwise
+class mapped_file {
+public:
+    explicit mapped_file(const char* path)
+    {
+#if AOC_INTCODE_HAVE_MMAP
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            throw_error("Could not open {}\n", path);
+        }
+        struct ::stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data_ = static_cast<const char*>(addr);
+                size_ = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+        if (st.st_size > 0 && !data_) {
+            throw_error("Could not map {}\n", path);
+        }
+#else
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream) {
+            throw_error("Could not open {}\n", path);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+#if AOC_INTCODE_HAVE_MMAP
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    std::string_view view() const { return {data_, size_}; }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+#if !AOC_INTCODE_HAVE_MMAP
+    std::string buffer_;
+#endif
+};
+
+// Parses a comma-separated Intcode program. Whitespace around the numbers
+// (such as the newline at the end of the file) is ignored.
+inline std::vector<int64_t> parse_program(std::string_view text)
+{
+    const char* first = text.data();
+    const char* const last = first + text.size();
+
+    auto skip_space = [&] {
+        while (first != last && std::isspace(static_cast<unsigned char>(*first))) {
+            ++first;
+        }
+    };
+
+    std::vector<int64_t> prog;
+    prog.reserve(std::count(first, last, ',') + 1);
+
+    skip_space();
+    while (first != last) {
+        int64_t val = 0;
+        const auto [next, ec] = std::from_chars(first, last, val);
+        if (ec != std::errc{}) {
+            throw_error("Bad Intcode program: unexpected '{}' at offset {}\n",
+                        *first, first - text.data());
+        }
+        prog.push_back(val);
+        first = next;
+
+        skip_space();
+        if (first != last && *first == ',') {
+            ++first;
+            skip_space();
+        }
+    }
+
+    return prog;
+}
+
+// Programs can also be stored as binary images, which load without any
+// parsing. An image is a header, followed by the words of the program as
+// 64-bit integers, optionally followed by the program's instructions as
+// decoded by predecode(). Each of those takes 32 bytes: the handler, the
+// covered flag, six bytes of padding and the three operands. Everything is
+// little-endian.
+struct image_header {
+    static constexpr std::size_t size = 32;
+    static constexpr std::size_t insn_size = 32;
+    static constexpr std::string_view magic{"INTCODE\0", 8};
+    static constexpr uint32_t current_version = 1;
+
+    uint32_t version = current_version;
+    uint32_t word_size = 8;
+    uint64_t length = 0;
+    // The handler_fingerprint() of the build which decoded the instructions,
+    // or zero if they aren't included
+    uint32_t fingerprint = 0;
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+inline constexpr bool little_endian = false;
+#else
+inline constexpr bool little_endian = true;
+#endif
+
+template <typename T>
+T read_le(const char* bytes)
+{
+    uint64_t val = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        val |= uint64_t{static_cast<uint8_t>(bytes[i])} << (8 * i);
+    }
+    return static_cast<T>(val);
+}
+
+inline bool is_program_image(std::string_view bytes)
+{
+    return bytes.substr(0, image_header::magic.size()) == image_header::magic;
+}
+
+inline image_header read_image_header(std::string_view bytes)
+{
+    if (!is_program_image(bytes) || bytes.size() < image_header::size) {
+        throw_error("Not an Intcode image\n");
+    }
+
+    image_header header;
+    header.version = read_le<uint32_t>(bytes.data() + 8);
+    header.word_size = read_le<uint32_t>(bytes.data() + 12);
+    header.length = read_le<uint64_t>(bytes.data() + 16);
+    header.fingerprint = read_le<uint32_t>(bytes.data() + 24);
+
+    if (header.version != image_header::current_version) {
+        throw_error("Unsupported Intcode image version {}\n", header.version);
+    }
+    if (header.word_size != 8) {
+        throw_error("Unsupported Intcode image word size {}\n", header.word_size);
+    }
+    const uint64_t per_word = 8 + (header.fingerprint != 0 ? image_header::insn_size : 0);
+    if (header.length > (bytes.size() - image_header::size) / per_word) {
+        throw_error("Intcode image is truncated\n");
+    }
+    return header;
+}
+
+inline void write_image(const char* path, const std::vector<int64_t>& prog, bool with_code = true)
+{
+    std::string bytes;
+    bytes.reserve(image_header::size + prog.size() * (8 + (with_code ? image_header::insn_size : 0)));
+
+    auto put = [&bytes](uint64_t val, std::size_t size) {
+        for (std::size_t i = 0; i < size; i++) {
+            bytes.push_back(static_cast<char>(val >> (8 * i)));
+        }
+    };
+
+    bytes.append(image_header::magic);
+    put(image_header::current_version, 4);
+    put(8, 4);
+    put(prog.size(), 8);
+    put(with_code ? handler_fingerprint() : 0, 4);
+    put(0, 4);
+
+    for (const auto word : prog) {
+        put(static_cast<uint64_t>(word), 8);
+    }
+
+    if (with_code) {
+        for (const auto& insn : predecode(prog)) {
+            put(static_cast<uint8_t>(insn.handler), 1);
+            put(insn.covered, 1);
+            put(0, 6);
+            for (const auto op : insn.operands) {
+                put(static_cast<uint64_t>(op), 8);
+            }
+        }
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.write(bytes.data(), bytes.size())) {
+        throw_error("Could not write {}\n", path);
+    }
+}
+
+// A binary program image, mapped into memory. On little-endian machines the
+// words of the program are used straight from the mapping, so a VM can be
+// made from the image without parsing or converting anything, e.g.
+//
+//     const aoc::program_image image(path);
+//     auto vm = image.make_vm();
+//
+// The decoded instructions are read once, and shared by every VM made from
+// the image.
+class program_image {
+public:
+    explicit program_image(const char* path)
+        : file_(path),
+          header_(read_image_header(file_.view()))
+    {
+        if constexpr (!little_endian) {
+            swapped_.resize(header_.length);
+            for (uint64_t i = 0; i < header_.length; i++) {
+                swapped_[i] = read_le<int64_t>(word_bytes() + 8 * i);
+            }
+        }
+        if (auto code = this->code()) {
+            shared_code_ = std::make_shared<std::vector<decoded_instruction>>(std::move(*code));
+        }
+    }
+
+    const image_header& header() const { return header_; }
+
+    nano::subrange<const int64_t*> words() const
+    {
+        if constexpr (little_endian) {
+            const auto* first = reinterpret_cast<const int64_t*>(word_bytes());
+            return {first, first + header_.length};
+        } else {
+            return {swapped_.data(), swapped_.data() + swapped_.size()};
+        }
+    }
+
+    // The decoded instructions, if the image has them and they were decoded
+    // by a build which agrees with us about the handlers
+    std::optional<std::vector<decoded_instruction>> code() const
+    {
+        if (header_.fingerprint != handler_fingerprint()) {
+            return std::nullopt;
+        }
+
+        std::vector<decoded_instruction> code(header_.length);
+        const char* bytes = word_bytes() + 8 * header_.length;
+        for (auto& insn : code) {
+            if (static_cast<uint8_t>(bytes[0]) >= num_handler_ids) {
+                throw_error("Bad handler {} in Intcode image\n", static_cast<uint8_t>(bytes[0]));
+            }
+            insn.handler = static_cast<handler_id>(bytes[0]);
+            insn.covered = bytes[1] != 0;
+            for (std::size_t i = 0; i < insn.operands.size(); i++) {
+                insn.operands[i] = read_le<int64_t>(bytes + 8 + 8 * i);
+            }
+            bytes += image_header::insn_size;
+        }
+        return code;
+    }
+
+    // A VM running the program, starting with its instructions decoded if
+    // the image has them
+    template <typename VM = intcode<>>
+    VM make_vm() const
+    {
+        if (shared_code_) {
+            return VM(words(), shared_code_);
+        }
+        return VM(words());
+    }
+
+private:
+    const char* word_bytes() const { return file_.view().data() + image_header::size; }
+
+    mapped_file file_;
+    image_header header_;
+    std::vector<int64_t> swapped_;
+    std::shared_ptr<std::vector<decoded_instruction>> shared_code_;
+};
+
+// Loads a program from either a text file or a binary image
+inline std::vector<int64_t> load_program(const char* path)
+{
+    const mapped_file file(path);
+    const auto bytes = file.view();
+    if (!is_program_image(bytes)) {
+        return parse_program(bytes);
+    }
+
+    const auto header = read_image_header(bytes);
+    std::vector<int64_t> prog(header.length);
+    const char* words = bytes.data() + image_header::size;
+    if constexpr (little_endian) {
+        std::memcpy(prog.data(), words, 8 * header.length);
+    } else {
+        for (uint64_t i = 0; i < header.length; i++) {
+            prog[i] = read_le<int64_t>(words + 8 * i);
+        }
+    }
+    return prog;
+}
+
+// A checkpoint holds a running VM, so that a long session can be picked up
+// again (or several VMs started from the same point) without running the
+// program from the beginning. It has a 64-byte header:
+//
+//   0  magic "ICCHECK\0"
+//   8  version (4 bytes), flags (4 bytes: 1 = input pending, 2 = halted)
+//   16 iptr, relbase, pending input, last output, length of the original
+//      program and number of pages (8 bytes each)
+//
+// followed by each page of memory in use: its page number (8 bytes) and
+// its words (8 bytes each). Pages which are all zero are left out. As with
+// images, everything is little-endian.
+struct checkpoint_header {
+    static constexpr std::size_t size = 64;
+    static constexpr std::string_view magic{"ICCHECK\0", 8};
+    static constexpr uint32_t current_version = 1;
+    static constexpr std::size_t page_bytes = 8 + 8 * paged_memory::page_size;
+
+    static constexpr uint32_t has_pending_input = 1;
+    static constexpr uint32_t done = 2;
+};
+
+template <dispatch Dispatch, bool Profile>
+void save_checkpoint(const intcode<paged_memory, Dispatch, Profile>& vm, const char* path)
+{
+    const auto st = vm.get_state();
+
+    std::string pages;
+    uint64_t num_pages = 0;
+    vm.memory().for_each_page([&](int64_t n, const paged_memory::page& p) {
+        if (nano::all_of(p, [](int64_t word) { return word == 0; })) {
+            return;
+        }
+        ++num_pages;
+        const auto offset = pages.size();
+        pages.resize(offset + checkpoint_header::page_bytes);
+        char* out = pages.data() + offset;
+        for (std::size_t i = 0; i < 8; i++) {
+            out[i] = static_cast<char>(static_cast<uint64_t>(n) >> (8 * i));
+        }
+        if constexpr (little_endian) {
+            std::memcpy(out + 8, p.data(), 8 * p.size());
+        } else {
+            for (std::size_t w = 0; w < p.size(); w++) {
+                for (std::size_t i = 0; i < 8; i++) {
+                    out[8 + 8 * w + i] = static_cast<char>(static_cast<uint64_t>(p[w]) >> (8 * i));
+                }
+            }
+        }
+    });
+
+    std::string bytes;
+    auto put = [&bytes](uint64_t val, std::size_t size) {
+        for (std::size_t i = 0; i < size; i++) {
+            bytes.push_back(static_cast<char>(val >> (8 * i)));
+        }
+    };
+
+    bytes.append(checkpoint_header::magic);
+    put(checkpoint_header::current_version, 4);
+    put((st.has_pending_input ? checkpoint_header::has_pending_input : 0u) |
+        (st.done ? checkpoint_header::done : 0u), 4);
+    for (const auto reg : {st.iptr, st.relbase, st.pending_input, st.output}) {
+        put(static_cast<uint64_t>(reg), 8);
+    }
+    put(st.image_size, 8);
+    put(num_pages, 8);
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.write(bytes.data(), bytes.size()) || !out.write(pages.data(), pages.size())) {
+        throw_error("Could not write {}\n", path);
+    }
+}
+
+// Makes a VM which carries on from a checkpoint. Its pages are shared with
+// any copies, so starting many VMs from one checkpoint only reads it once.
+template <typename VM = intcode<>>
+VM load_checkpoint(const char* path)
+{
+    const mapped_file file(path);
+    const auto bytes = file.view();
+    if (bytes.substr(0, checkpoint_header::magic.size()) != checkpoint_header::magic ||
+        bytes.size() < checkpoint_header::size) {
+        throw_error("{} is not an Intcode checkpoint\n", path);
+    }
+
+    const char* data = bytes.data();
+    if (const auto version = read_le<uint32_t>(data + 8);
+        version != checkpoint_header::current_version) {
+        throw_error("Unsupported Intcode checkpoint version {}\n", version);
+    }
+
+    const auto flags = read_le<uint32_t>(data + 12);
+    typename VM::state st;
+    st.has_pending_input = (flags & checkpoint_header::has_pending_input) != 0;
+    st.done = (flags & checkpoint_header::done) != 0;
+    st.iptr = read_le<int64_t>(data + 16);
+    st.relbase = read_le<int64_t>(data + 24);
+    st.pending_input = read_le<int64_t>(data + 32);
+    st.output = read_le<int64_t>(data + 40);
+    st.image_size = read_le<uint64_t>(data + 48);
+
+    const auto num_pages = read_le<uint64_t>(data + 56);
+    if (num_pages > (bytes.size() - checkpoint_header::size) / checkpoint_header::page_bytes) {
+        throw_error("Intcode checkpoint {} is truncated\n", path);
+    }
+
+    paged_memory memory;
+    const char* page_data = data + checkpoint_header::size;
+    for (uint64_t n = 0; n < num_pages; n++) {
+        auto p = std::make_shared<paged_memory::page>();
+        if constexpr (little_endian) {
+            std::memcpy(p->data(), page_data + 8, 8 * p->size());
+        } else {
+            for (std::size_t w = 0; w < p->size(); w++) {
+                (*p)[w] = read_le<int64_t>(page_data + 8 + 8 * w);
+            }
+        }
+        memory.set_page(read_le<int64_t>(page_data), std::move(p));
+        page_data += checkpoint_header::page_bytes;
+    }
+
+    return VM(std::move(memory), st);
+}
+
+} // namespace aoc
+
+#endif
@@ -0,0 +1,50 @@
+
+#include "../trace.hpp"
+
+// Replays a trace recorded by one of the days (for example with day 13's
+// --record option), checking that the program does exactly what it did when
+// the trace was made, and times how long the replay takes. Nothing but the
+// interpreter runs, so this shows how fast the session could have gone.
+//
+// Usage: ./main trace.bin [iterations]
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fmt::print(stderr, "Usage: {} trace.bin [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const auto t = aoc::load_trace(argv[1]);
+    const int iterations = argc > 2 ? std::stoi(argv[2]) : 10;
+
+    fmt::print("{} words of program, {} inputs, {} outputs\n",
+               t.program.size(), t.inputs.size(), t.outputs.size());
+
+    std::vector<double> timings;
+
+    for (int i = 0; i < iterations; i++) {
+        const auto start = clock_type::now();
+        aoc::intcode vm{t.program};
+        aoc::replay(vm, t);
+        const auto end = clock_type::now();
+        timings.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+
+    if (timings.empty()) {
+        return 0;
+    }
+
+    nano::sort(timings);
+    const auto mean = aoc::accumulate(timings, 0.0) / timings.size();
+
+    fmt::print("Replay matched the trace\n");
+    fmt::print("{} runs: min {:.1f}us, median {:.1f}us, mean {:.1f}us\n",
+               iterations, timings.front(), timings[timings.size() / 2], mean);
+}
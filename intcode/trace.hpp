@@ -0,0 +1,213 @@
+#ifndef ADVENT_OF_CODE_2019_INTCODE_TRACE_HPP
+#define ADVENT_OF_CODE_2019_INTCODE_TRACE_HPP
+
+#include "intcode.hpp"
+
+namespace aoc {
+
+// Traces record a run of a program -- the program itself, every input it
+// consumed and every output it produced -- so that the run can be replayed
+// later without whatever produced the inputs (a human at a keyboard, say).
+//
+// A trace file starts with the magic string "ICTRACE\0", followed by
+// varints: the format version, the length of the program and its words.
+// Then come the events, as a series of groups: the number of outputs the
+// program produced before its next input, those outputs, and the input.
+// The last group has no input. Each value is stored as the difference from
+// the previous output (or input), so the numbers stay small.
+
+inline constexpr std::string_view trace_magic{"ICTRACE\0", 8};
+inline constexpr uint64_t trace_version = 1;
+
+class trace_recorder {
+public:
+    template <typename Program>
+    explicit trace_recorder(const Program& prog)
+    {
+        bytes_.append(trace_magic);
+        put(trace_version);
+        put(static_cast<uint64_t>(nano::distance(prog)));
+        int64_t prev = 0;
+        for (const auto& word : prog) {
+            put_delta(prev, word);
+        }
+    }
+
+    void input(int64_t val)
+    {
+        flush_outputs();
+        put_delta(last_input_, val);
+    }
+
+    void output(int64_t val) { outputs_.push_back(val); }
+
+    // Wraps I/O functions so that the values going through them are recorded
+    template <typename In>
+    auto reader(In in_fn)
+    {
+        return [this, in_fn]() mutable {
+            const auto val = int64_t{in_fn()};
+            input(val);
+            return val;
+        };
+    }
+
+    template <typename Out>
+    auto writer(Out out_fn)
+    {
+        return [this, out_fn](int64_t val) mutable {
+            output(val);
+            out_fn(val);
+        };
+    }
+
+    void save(const char* path)
+    {
+        flush_outputs();
+        std::ofstream out(path, std::ios::binary);
+        if (!out.write(bytes_.data(), bytes_.size())) {
+            throw_error("Could not write {}\n", path);
+        }
+    }
+
+private:
+    void put(uint64_t val)
+    {
+        while (val >= 0x80) {
+            bytes_.push_back(static_cast<char>(val | 0x80));
+            val >>= 7;
+        }
+        bytes_.push_back(static_cast<char>(val));
+    }
+
+    // Zigzag encoded, so that small negative differences stay small
+    void put_delta(int64_t& prev, int64_t val)
+    {
+        const auto delta = static_cast<int64_t>(static_cast<uint64_t>(val) - static_cast<uint64_t>(prev));
+        put((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+        prev = val;
+    }
+
+    void flush_outputs()
+    {
+        put(outputs_.size());
+        for (const auto val : outputs_) {
+            put_delta(last_output_, val);
+        }
+        outputs_.clear();
+    }
+
+    std::string bytes_;
+    std::vector<int64_t> outputs_;
+    int64_t last_input_ = 0;
+    int64_t last_output_ = 0;
+};
+
+struct trace {
+    std::vector<int64_t> program;
+    std::vector<int64_t> inputs;
+    std::vector<int64_t> outputs;
+    // How many outputs the program had produced when it read each input
+    std::vector<std::size_t> outputs_before;
+};
+
+inline trace load_trace(const char* path)
+{
+    const mapped_file file(path);
+    const auto bytes = file.view();
+    if (bytes.substr(0, trace_magic.size()) != trace_magic) {
+        throw_error("{} is not an Intcode trace\n", path);
+    }
+
+    std::size_t pos = trace_magic.size();
+
+    auto get = [&] {
+        uint64_t val = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos == bytes.size()) {
+                throw_error("Intcode trace {} is truncated\n", path);
+            }
+            const auto byte = static_cast<uint8_t>(bytes[pos++]);
+            val |= uint64_t{byte & 0x7fu} << shift;
+            if (byte < 0x80) {
+                return val;
+            }
+        }
+        throw_error("Bad varint in Intcode trace {}\n", path);
+    };
+
+    auto get_delta = [&](int64_t& prev) {
+        const auto zigzag = get();
+        const auto delta = static_cast<int64_t>((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+        prev = static_cast<int64_t>(static_cast<uint64_t>(prev) + static_cast<uint64_t>(delta));
+        return prev;
+    };
+
+    if (const auto version = get(); version != trace_version) {
+        throw_error("Unsupported Intcode trace version {}\n", version);
+    }
+
+    trace t;
+    t.program.resize(get());
+    int64_t prev = 0;
+    for (auto& word : t.program) {
+        word = get_delta(prev);
+    }
+
+    int64_t last_input = 0;
+    int64_t last_output = 0;
+    while (true) {
+        const auto num_outputs = get();
+        for (uint64_t i = 0; i < num_outputs; i++) {
+            t.outputs.push_back(get_delta(last_output));
+        }
+        if (pos == bytes.size()) {
+            break;
+        }
+        t.outputs_before.push_back(t.outputs.size());
+        t.inputs.push_back(get_delta(last_input));
+    }
+
+    return t;
+}
+
+// Runs `vm` (made from the trace's program), feeding it the recorded inputs,
+// and checks that it produces the recorded outputs in the same places.
+// Throws at the first difference.
+template <typename VM>
+void replay(VM& vm, const trace& t)
+{
+    std::size_t num_inputs = 0;
+    std::size_t num_outputs = 0;
+
+    auto in_fn = [&] {
+        if (num_inputs == t.inputs.size()) {
+            throw_error("Replay wanted more than the {} inputs recorded\n", t.inputs.size());
+        }
+        if (num_outputs != t.outputs_before[num_inputs]) {
+            throw_error("Replay read input {} after {} outputs, but it was recorded after {}\n",
+                        num_inputs, num_outputs, t.outputs_before[num_inputs]);
+        }
+        return t.inputs[num_inputs++];
+    };
+
+    auto out_fn = [&](int64_t val) {
+        if (num_outputs == t.outputs.size() || t.outputs[num_outputs] != val) {
+            throw_error("Replay output {} was {}, but {} was recorded\n", num_outputs, val,
+                        num_outputs < t.outputs.size() ? fmt::format("{}", t.outputs[num_outputs])
+                                                       : std::string("nothing"));
+        }
+        ++num_outputs;
+    };
+
+    vm.run(in_fn, out_fn);
+
+    if (num_inputs != t.inputs.size() || num_outputs != t.outputs.size()) {
+        throw_error("Replay halted after {} inputs and {} outputs, but {} and {} were recorded\n",
+                    num_inputs, num_outputs, t.inputs.size(), t.outputs.size());
+    }
+}
+
+} // namespace aoc
+
+#endif
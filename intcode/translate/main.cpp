@@ -0,0 +1,443 @@
+
+#include "../intcode.hpp"
+
+#include <optional>
+#include <set>
+
+// Translates an Intcode program into C++. Every instruction reachable from
+// the start of the program -- following fall-throughs, constant jump targets,
+// and any other constants the program uses, in case they are return
+// addresses -- becomes a labelled statement in a single function, with
+// registers in locals and operands baked in as constants.
+//
+// The generated header declares
+//
+//     template <typename VM, typename In, typename Out>
+//     void NAME::run(VM& vm, In in_fn, Out out_fn);
+//
+// which runs a freshly-constructed aoc::intcode VM to completion, like
+// vm.run(in_fn, out_fn) would. It keeps track of writes to the words the
+// translation was made from. If the program jumps (or falls through) into
+// code which has been changed, the VM's registers are set and the
+// interpreter takes over from there. Halting hands over to the interpreter
+// too, so that vm.done() is set as usual.
+//
+// Words named with --param are ones the caller changes before running, like
+// the noun and verb of day 2: they are read from memory rather than baked in.
+//
+// Usage: ./main input.txt [--name NAME] [--param ADDR]... > program.hpp
+//
+// The output includes "intcode/intcode.hpp", so compile with the top level
+// of this repository on the include path.
+
+namespace {
+
+struct translator {
+    std::vector<int64_t> image;
+    std::vector<bool> params;
+    std::vector<std::optional<aoc::instruction>> insns{};
+    std::vector<bool> covered{};
+    std::vector<int64_t> run_end{};
+    std::set<int64_t> labels{};
+    bool dynamic_jumps = false;
+
+    int64_t size() const { return static_cast<int64_t>(image.size()); }
+
+    bool translated(int64_t addr) const
+    {
+        return addr >= 0 && addr < size() && insns[addr].has_value();
+    }
+
+    std::optional<aoc::instruction> decode(int64_t addr) const
+    {
+        if (addr < 0 || addr >= size() || params[addr] ||
+            !aoc::is_valid_opcode(image[addr] % 100)) {
+            return std::nullopt;
+        }
+        try {
+            const auto insn = aoc::decode_instruction(image[addr]);
+            if (addr + aoc::num_params(insn.op) >= size()) {
+                return std::nullopt;
+            }
+            return insn;
+        } catch (const std::runtime_error&) {
+            // Bad parameter modes: leave it for the interpreter to report
+            return std::nullopt;
+        }
+    }
+
+    static bool is_jump(aoc::opcode op)
+    {
+        return op == aoc::opcode::jnz || op == aoc::opcode::jz;
+    }
+
+    // The constant value of operand `i`, if it has one
+    std::optional<int64_t> constant(int64_t addr, int i) const
+    {
+        const auto word = addr + i + 1;
+        if (params[word]) {
+            return std::nullopt;
+        }
+        return image[word];
+    }
+
+    // Whether control never continues to the next instruction
+    bool ends_run(int64_t addr) const
+    {
+        const auto& insn = *insns[addr];
+        if (insn.op == aoc::opcode::halt) {
+            return true;
+        }
+        if (is_jump(insn.op) && insn.modes[0] == aoc::param_mode::immediate) {
+            if (const auto cond = constant(addr, 0)) {
+                return (insn.op == aoc::opcode::jnz) == (*cond != 0);
+            }
+        }
+        return false;
+    }
+
+    void find_code()
+    {
+        insns.resize(image.size());
+        covered.resize(image.size());
+
+        std::vector<int64_t> work{0};
+
+        auto add_candidate = [&](std::optional<int64_t> addr) {
+            if (addr && *addr >= 0 && *addr < size() && !insns[*addr]) {
+                work.push_back(*addr);
+            }
+        };
+
+        while (!work.empty()) {
+            auto addr = work.back();
+            work.pop_back();
+
+            while (!translated(addr)) {
+                const auto insn = decode(addr);
+                if (!insn) {
+                    break;
+                }
+                insns[addr] = insn;
+
+                const int nparams = aoc::num_params(insn->op);
+                for (int i = 0; i <= nparams; i++) {
+                    covered[addr + i] = !params[addr + i];
+                }
+
+                for (int i = 0; i < nparams; i++) {
+                    if (insn->modes[i] == aoc::param_mode::immediate) {
+                        add_candidate(constant(addr, i));
+                    }
+                }
+                // A jump through memory probably goes to the address stored there
+                if (is_jump(insn->op) && insn->modes[1] == aoc::param_mode::position) {
+                    if (const auto ptr = constant(addr, 1); ptr && *ptr >= 0 && *ptr < size() && !params[*ptr]) {
+                        add_candidate(image[*ptr]);
+                    }
+                }
+
+                if (ends_run(addr)) {
+                    break;
+                }
+                addr += nparams + 1;
+            }
+        }
+
+        // A run of code lasts until control is sure to go elsewhere
+        run_end.resize(image.size());
+        for (auto addr = size() - 1; addr >= 0; addr--) {
+            if (!translated(addr)) {
+                continue;
+            }
+            const auto next = addr + aoc::num_params(insns[addr]->op) + 1;
+            run_end[addr] = ends_run(addr) || !translated(next) ? next : run_end[next];
+        }
+    }
+
+    std::string word(int64_t addr) const
+    {
+        if (params[addr]) {
+            return fmt::format("load({})", addr);
+        }
+        return fmt::format("{}", image[addr]);
+    }
+
+    std::string get(int64_t addr, int i) const
+    {
+        const auto w = word(addr + i + 1);
+        switch (insns[addr]->modes[i]) {
+        case aoc::param_mode::position:
+            return fmt::format("load({})", w);
+        case aoc::param_mode::immediate:
+            return w;
+        case aoc::param_mode::relative:
+            return fmt::format("load(rb + {})", w);
+        }
+        return {};
+    }
+
+    std::string dest(int64_t addr, int i) const
+    {
+        switch (insns[addr]->modes[i]) {
+        case aoc::param_mode::position:
+            return word(addr + i + 1);
+        case aoc::param_mode::immediate:
+            return fmt::format("{}", addr + i + 1);
+        case aoc::param_mode::relative:
+            return fmt::format("rb + {}", word(addr + i + 1));
+        }
+        return {};
+    }
+
+    // Transfers control to a constant address
+    std::string go_to(int64_t target)
+    {
+        if (!translated(target)) {
+            return fmt::format("return bail({});", target);
+        }
+        labels.insert(target);
+        return fmt::format("if (dirty_any && !intact({0}, {1})) {{ return bail({0}); }} goto L{0};",
+                           target, run_end[target]);
+    }
+
+    std::string jump(int64_t addr, int i)
+    {
+        if (insns[addr]->modes[i] == aoc::param_mode::immediate) {
+            if (const auto target = constant(addr, i)) {
+                return go_to(*target);
+            }
+        }
+        dynamic_jumps = true;
+        return fmt::format("target = {}; goto dispatch;", get(addr, i));
+    }
+
+    // Stores a value, bailing out if that changes the code still to come in
+    // this run
+    std::string store(int64_t addr, int i, const std::string& val) const
+    {
+        const auto next = addr + aoc::num_params(insns[addr]->op) + 1;
+        if (!translated(next)) {
+            return fmt::format("store({}, {}, 0, 0);", dest(addr, i), val);
+        }
+        return fmt::format("if (store({}, {}, {}, {})) {{ return bail({}); }}",
+                           dest(addr, i), val, next, run_end[next], next);
+    }
+
+    std::string statement(int64_t addr)
+    {
+        using aoc::opcode;
+
+        switch (insns[addr]->op) {
+        case opcode::add:
+            return store(addr, 2, fmt::format("{} + {}", get(addr, 0), get(addr, 1)));
+        case opcode::mul:
+            return store(addr, 2, fmt::format("{} * {}", get(addr, 0), get(addr, 1)));
+        case opcode::in:
+            return store(addr, 0, "in_fn()");
+        case opcode::out:
+            return fmt::format("out_fn({});", get(addr, 0));
+        case opcode::jnz:
+            if (ends_run(addr)) {
+                return jump(addr, 1);
+            }
+            return fmt::format("if ({} != 0) {{ {} }}", get(addr, 0), jump(addr, 1));
+        case opcode::jz:
+            if (ends_run(addr)) {
+                return jump(addr, 1);
+            }
+            return fmt::format("if ({} == 0) {{ {} }}", get(addr, 0), jump(addr, 1));
+        case opcode::lt:
+            return store(addr, 2, fmt::format("{} < {} ? 1 : 0", get(addr, 0), get(addr, 1)));
+        case opcode::eq:
+            return store(addr, 2, fmt::format("{} == {} ? 1 : 0", get(addr, 0), get(addr, 1)));
+        case opcode::rbo:
+            return fmt::format("rb += {};", get(addr, 0));
+        case opcode::halt:
+            return fmt::format("return bail({});", addr);
+        }
+        return {};
+    }
+
+    void emit(const char* path, const std::string& name)
+    {
+        const auto entry = go_to(0);
+
+        // Only the labels which get jumped to can be written out, so the
+        // statements are kept separate until they have all been generated
+        std::vector<std::pair<int64_t, std::string>> statements;
+        for (int64_t addr = 0; addr < size(); addr++) {
+            if (!translated(addr)) {
+                continue;
+            }
+            auto stmt = statement(addr);
+
+            const auto next = addr + aoc::num_params(insns[addr]->op) + 1;
+            if (!ends_run(addr)) {
+                // Carry on to the next instruction, unless that's not the
+                // next one written out (because it overlaps this one)
+                int64_t next_label = addr + 1;
+                while (next_label < size() && !translated(next_label)) {
+                    next_label++;
+                }
+                if (next_label != next) {
+                    if (translated(next)) {
+                        labels.insert(next);
+                        stmt += fmt::format("\n    goto L{};", next);
+                    } else {
+                        stmt += fmt::format("\n    return bail({});", next);
+                    }
+                }
+            }
+            statements.emplace_back(addr, std::move(stmt));
+        }
+
+        std::string dispatch;
+        if (dynamic_jumps) {
+            dispatch = "dispatch:\n    switch (target) {\n";
+            for (int64_t addr = 0; addr < size(); addr++) {
+                if (translated(addr)) {
+                    dispatch += fmt::format("    case {}: {}\n", addr, go_to(addr));
+                }
+            }
+            dispatch += "    }\n    return bail(target);\n";
+        }
+
+        std::string body;
+        for (const auto& [addr, stmt] : statements) {
+            if (labels.count(addr) != 0) {
+                body += fmt::format("L{}:\n", addr);
+            }
+            body += fmt::format("    {}\n", stmt);
+        }
+        body += dispatch;
+
+        auto join = [](const auto& vals) {
+            std::string out;
+            for (const auto& v : vals) {
+                out += fmt::format("{},", v);
+            }
+            return out;
+        };
+
+        fmt::print(R"(// Generated from {path} by intcode/translate: do not edit
+
+#include "intcode/intcode.hpp"
+
+namespace {name} {{
+
+inline constexpr int64_t image_size = {size};
+// How much memory is kept locally while the translated code runs
+inline constexpr int64_t memory_size = image_size + 1024;
+inline constexpr int64_t image[] = {{{image}}};
+// The words which the translation assumes still hold their original values
+inline constexpr bool covered[] = {{{covered}}};
+
+template <typename VM, typename In, typename Out>
+void run(VM& vm, In in_fn, Out out_fn)
+{{
+    int64_t rb = 0;
+    {target}
+    std::array<bool, image_size> dirty{{}};
+    bool dirty_any = false;
+
+    // The start of memory is copied into a plain array, which is copied back
+    // to the VM before the interpreter takes over
+    std::vector<int64_t> mem(memory_size);
+    int64_t mem_used = image_size;
+    for (int64_t addr = 0; addr < image_size; addr++) {{
+        mem[addr] = vm.peek(addr);
+    }}
+
+    auto load = [&](int64_t addr) {{
+        return static_cast<uint64_t>(addr) < memory_size ? mem[addr] : vm.peek(addr);
+    }};
+
+    // Returns true if this changed a covered word in [lo, hi)
+    auto store = [&](int64_t addr, int64_t val, int64_t lo, int64_t hi) {{
+        if (static_cast<uint64_t>(addr) < memory_size) {{
+            mem[addr] = val;
+            mem_used = std::max(mem_used, addr + 1);
+        }} else {{
+            vm.poke(addr, val);
+        }}
+        if (addr < 0 || addr >= image_size || !covered[addr]) {{
+            return false;
+        }}
+        dirty[addr] = val != image[addr];
+        dirty_any = dirty_any || dirty[addr];
+        return dirty[addr] && addr >= lo && addr < hi;
+    }};
+
+    auto intact = [&](int64_t lo, int64_t hi) {{
+        for (auto addr = lo; addr < hi; addr++) {{
+            if (dirty[addr]) {{
+                return false;
+            }}
+        }}
+        return true;
+    }};
+
+    // Hands over to the interpreter
+    auto bail = [&](int64_t addr) {{
+        for (int64_t i = 0; i < mem_used; i++) {{
+            if (mem[i] != vm.peek(i)) {{
+                vm.poke(i, mem[i]);
+            }}
+        }}
+        vm.jump(addr, rb);
+        vm.run(in_fn, out_fn);
+    }};
+
+    for (int64_t addr = 0; addr < image_size; addr++) {{
+        if (covered[addr] && mem[addr] != image[addr]) {{
+            dirty[addr] = dirty_any = true;
+        }}
+    }}
+
+    {entry}
+
+{body}}}
+
+}} // namespace {name}
+)",
+            fmt::arg("path", path), fmt::arg("name", name), fmt::arg("size", size()),
+            fmt::arg("image", join(image)), fmt::arg("covered", join(covered)),
+            fmt::arg("target", dynamic_jumps ? "int64_t target = 0;" : ""),
+            fmt::arg("entry", entry), fmt::arg("body", body));
+    }
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fmt::print(stderr, "Usage: {} input.txt [--name NAME] [--param ADDR]...\n", argv[0]);
+        return 1;
+    }
+
+    translator t{aoc::load_program(argv[1]), {}};
+    t.params.resize(t.image.size());
+    std::string name = "translated";
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        const std::string_view opt = argv[i];
+        if (opt == "--name") {
+            name = argv[i + 1];
+        } else if (opt == "--param") {
+            const auto addr = std::stoll(argv[i + 1]);
+            if (addr < 0 || addr >= t.size()) {
+                fmt::print(stderr, "Parameter address {} is outside the program\n", addr);
+                return 1;
+            }
+            t.params[addr] = true;
+        } else {
+            fmt::print(stderr, "Unknown option {}\n", opt);
+            return 1;
+        }
+    }
+
+    t.find_code();
+    t.emit(argv[1], name);
+}